@@ -0,0 +1,45 @@
+#!/usr/bin/bash
+# Compare the time taken, and the size of the EPUB, for each of the
+#  --compression modes. The input is the given text file or, by default,
+#  generated text made of words chosen at random, which compresses about
+#  as well as real prose; very repetitive text would flatter every mode.
+# Usage: compression.sh [text_file]
+
+TXT2EPUB=${TXT2EPUB:-../txt2epub}
+TMP=$(mktemp -d)
+TIMEFORMAT="%R s"
+
+INPUT=$1
+if [ -z "$INPUT" ]; then
+  INPUT=$TMP/words.txt
+  awk 'BEGIN {
+    srand (1);
+    n = split ("the of and to a in that it was he for on his with as at " \
+      "by be had not but from they this she her were which you all one " \
+      "house evening morning letter river window garden silence answer " \
+      "remembered happened certainly another everything nothing always " \
+      "Elizabeth Darcy London Bingley Netherfield _little_ *never*", w, " ");
+    for (p = 0; p < 40000; p++)
+      {
+      line = "";
+      for (i = 0; i < 60 + int (rand () * 60); i++)
+        {
+        line = line w[1 + int (rand () * n)] " ";
+        if (length (line) > 70) { print line; line = "" }
+        }
+      print line "\n";
+      }
+    }' > $INPUT
+fi
+
+SIZE=$(stat -c %s $INPUT)
+echo "$((SIZE / 1048576)) MB input"
+for mode in store fast default max; do
+  printf "%-8s " $mode
+  T=$( { time $TXT2EPUB --compression $mode -o $TMP/out.epub $INPUT; } \
+    2>&1 )
+  OUT=$(stat -c %s $TMP/out.epub)
+  echo "$T, $OUT bytes, $((OUT * 100 / SIZE))% of input"
+done
+
+rm -rf $TMP
@@ -0,0 +1,34 @@
+#!/usr/bin/bash
+# Time the conversion of a large, generated, book-like text file, with
+#  short wrapped lines, blank lines between paragraphs, and occasional
+#  Markdown. The default verbatim marker uses the single-pass formatter;
+#  a marker that is a regular expression ([`]) forces every line through
+#  the regular expression substitutions, so both are timed.
+# Usage: corpus.sh [size_in_MB]
+
+TXT2EPUB=${TXT2EPUB:-../txt2epub}
+MB=${1:-100}
+TMP=$(mktemp -d)
+TIMEFORMAT="%R s"
+
+PARA="#Chapter the Last
+
+   It was the best of times, it was the worst of times, it was the age
+of wisdom, it was the age of _foolishness_, it was the epoch of belief,
+it was the epoch of incredulity, it was the season of *Light*, it was
+the season of Darkness, it was the spring of hope & the winter of despair.
+
+   We had everything before us, we had nothing before us, we were all
+going direct to Heaven, we were all going direct the other way  
+                                                                 12
+"
+
+yes "$PARA" | head -c ${MB}M > $TMP/corpus.txt
+
+for marker in '`' '[`]'; do
+  echo -n "$MB MB corpus, verbatim marker '$marker': "
+  time $TXT2EPUB -r --verbatim-marker "$marker" -o $TMP/corpus.epub \
+    $TMP/corpus.txt
+done
+
+rm -rf $TMP
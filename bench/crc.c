@@ -0,0 +1,80 @@
+/*==========================================================================
+txt2epub
+bench/crc.c
+Measure the throughput of each implementation of kmscrc_update, and of
+zlib's crc32, on buffers of several sizes, checking that they agree.
+Usage: crc [total_MB]
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "kmscrc.h"
+
+/*==========================================================================
+now
+*==========================================================================*/
+static double now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+/*==========================================================================
+main
+*==========================================================================*/
+int main (int argc, char **argv)
+  {
+  int mb = argc > 1 ? atoi (argv[1]) : 256;
+  size_t total = (size_t)mb << 20;
+  // Sizes from a short line to a chapter; the largest is bigger than
+  //  most caches
+  size_t sizes[] = { 64, 1024, 32768, 1 << 20, 64 << 20 };
+  size_t max = sizes[4], i;
+  unsigned char *buff = malloc (max);
+  for (i = 0; i < max; i++)
+    buff[i] = (i * 2654435761u) >> 13;
+
+  const char *impls[] = { "zlib", "table", "slice8", "pclmul" };
+  printf ("%-8s", "");
+  int s, k;
+  for (s = 0; s < 5; s++)
+    printf ("%10zu", sizes[s]);
+  printf ("   (GB/s)\n");
+  for (k = 0; k < 4; k++)
+    {
+    if (k > 0 && !kmscrc_use (impls[k]))
+      {
+      printf ("%-8s not supported\n", impls[k]);
+      continue;
+      }
+    printf ("%-8s", impls[k]);
+    for (s = 0; s < 5; s++)
+      {
+      size_t n = total / sizes[s], j;
+      uint32_t crc = 0, check = 0;
+      double t = now ();
+      for (j = 0; j < n; j++)
+        {
+        if (k == 0)
+          crc = crc32 (crc, buff, sizes[s]);
+        else
+          crc = kmscrc_update (crc, buff, sizes[s]);
+        }
+      t = now () - t;
+      for (j = 0; j < n; j++)
+        check = crc32 (check, buff, sizes[s]);
+      printf ("%10.2f%s", (double)n * sizes[s] / t / 1e9,
+        crc == check ? "" : "!");
+      }
+    printf ("\n");
+    }
+  kmscrc_init ();
+  printf ("Selected: %s\n", kmscrc_impl ());
+  free (buff);
+  return 0;
+  }
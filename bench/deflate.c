@@ -0,0 +1,137 @@
+/*==========================================================================
+txt2epub
+bench/deflate.c
+Compare single-threaded zlib deflate with kmszip_deflate_blocks, at
+several block sizes, and with kmszip_deflate_rsyncable, on a text file
+or on generated prose. The CRC is
+included in the times, since the block version works it out too.
+Usage: deflate [file] [jobs]
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "kmslogging.h"
+#include "kmsparallel.h"
+#include "kmszip.h"
+
+static const char *prose =
+  "<p>It was a bright cold day in April, and the clocks were striking "
+  "thirteen. Winston Smith, his chin nuzzled into his breast in an effort "
+  "to escape the vile wind, slipped quickly through the glass doors of "
+  "Victory Mansions, though not quickly enough to prevent a swirl of "
+  "gritty dust from entering along with him.</p>\n";
+
+/*==========================================================================
+now
+*==========================================================================*/
+static double now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+/*==========================================================================
+load
+Read the whole of a file, or make 64MB of prose, numbering the
+sentences so that the text does not repeat exactly
+*==========================================================================*/
+static char *load (const char *file, size_t *len)
+  {
+  if (file)
+    {
+    FILE *f = fopen (file, "rb");
+    if (!f) return NULL;
+    fseek (f, 0, SEEK_END);
+    *len = ftell (f);
+    rewind (f);
+    char *buff = malloc (*len);
+    *len = fread (buff, 1, *len, f);
+    fclose (f);
+    return buff;
+    }
+  size_t size = 64 << 20, off = 0;
+  char *buff = malloc (size + 1024);
+  long n = 0;
+  while (off < size)
+    off += sprintf (buff + off, "%ld %s", n++, prose);
+  *len = off;
+  return buff;
+  }
+
+/*==========================================================================
+check
+Inflate the output, to make sure that it is a single valid stream
+*==========================================================================*/
+static int check (const void *deflated, size_t clen, const char *data,
+    size_t len, uint32_t crc)
+  {
+  char *out = malloc (len + 1);
+  z_stream zs;
+  memset (&zs, 0, sizeof (zs));
+  inflateInit2 (&zs, -MAX_WBITS);
+  zs.next_in = (Bytef *)deflated;
+  zs.avail_in = clen;
+  zs.next_out = (Bytef *)out;
+  zs.avail_out = len + 1;
+  int ret = inflate (&zs, Z_FINISH);
+  int ok = ret == Z_STREAM_END && zs.total_out == len
+    && memcmp (out, data, len) == 0 && crc == kmszip_crc (data, len);
+  inflateEnd (&zs);
+  free (out);
+  return ok;
+  }
+
+/*==========================================================================
+main
+*==========================================================================*/
+int main (int argc, char **argv)
+  {
+  kmslogging_set_level (ERROR);
+  size_t len;
+  char *data = load (argc > 1 ? argv[1] : NULL, &len);
+  if (!data)
+    {
+    fprintf (stderr, "Can't read %s\n", argv[1]);
+    return 1;
+    }
+  int jobs = argc > 2 ? atoi (argv[2]) : kmsparallel_cpus ();
+  printf ("%.1f MB, %d jobs\n", len / 1048576.0, jobs);
+
+  size_t blocks[] = { 0, 128, 512, 1024, 4096 };
+  int k;
+  for (k = 0; k < 5; k++)
+    {
+    size_t clen;
+    uint32_t crc;
+    double t = now ();
+    void *out = kmszip_deflate_blocks (data, len, Z_DEFAULT_COMPRESSION,
+      blocks[k] * 1024, jobs, &clen, &crc);
+    t = now () - t;
+    if (blocks[k] == 0)
+      printf ("zlib, one thread  ");
+    else
+      printf ("%4zu kB blocks     ", blocks[k]);
+    printf ("%7.3f s %8.1f MB/s  %5.2f%%  %s\n", t, len / t / 1048576.0,
+      100.0 * clen / len, check (out, clen, data, len, crc) ? "ok" : "BAD");
+    free (out);
+    }
+
+  // Blocks that end where the text says, as --rsyncable makes them
+  size_t clen;
+  uint32_t crc;
+  double t = now ();
+  void *out = kmszip_deflate_rsyncable (data, len, Z_DEFAULT_COMPRESSION,
+    1024 * 1024, jobs, &clen, &crc);
+  t = now () - t;
+  printf ("rsyncable         %7.3f s %8.1f MB/s  %5.2f%%  %s\n", t, 
+    len / t / 1048576.0, 100.0 * clen / len, 
+    check (out, clen, data, len, crc) ? "ok" : "BAD");
+  free (out);
+  free (data);
+  return 0;
+  }
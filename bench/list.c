@@ -0,0 +1,82 @@
+/*==========================================================================
+txt2epub
+bench/list.c
+Time the KMSList operations that a book with many chapters uses:
+appending every chapter title, then getting each one by its index,
+with and without the list's mutex.
+Usage: list [entries]
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kmslist.h"
+
+/*==========================================================================
+now
+*==========================================================================*/
+static double now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+/*==========================================================================
+run
+Build a list of n strings, and read it back, locked or not. Returns
+FALSE if what is read back is wrong.
+*==========================================================================*/
+static int run (int n, int locked)
+  {
+  char name[32];
+  int i;
+  double t = now ();
+  KMSList *list = kmslist_create_strings ();
+  for (i = 0; i < n; i++)
+    {
+    snprintf (name, sizeof (name), "Chapter %d", i);
+    if (locked)
+      kmslist_append (list, strdup (name));
+    else
+      kmslist_append_unlocked (list, strdup (name));
+    }
+  double append = now () - t;
+
+  t = now ();
+  long total = 0;
+  int len = locked ? kmslist_length (list) : kmslist_length_unlocked (list);
+  for (i = 0; i < len; i++)
+    {
+    const char *s = locked ? kmslist_get (list, i)
+      : kmslist_get_unlocked (list, i);
+    total += strlen (s);
+    }
+  double get = now () - t;
+
+  snprintf (name, sizeof (name), "Chapter %d", n - 1);
+  int ok = len == n && strcmp (kmslist_get (list, n - 1), name) == 0
+    && kmslist_get (list, n) == NULL && total > 0;
+  kmslist_destroy (list);
+
+  printf ("%-9s append %8.2f ms (%5.1f ns each), get %8.2f ms "
+    "(%5.1f ns each)  %s\n", locked ? "locked" : "unlocked",
+    append * 1e3, append * 1e9 / n, get * 1e3, get * 1e9 / n,
+    ok ? "ok" : "BAD");
+  return ok;
+  }
+
+/*==========================================================================
+main
+*==========================================================================*/
+int main (int argc, char **argv)
+  {
+  int n = argc > 1 ? atoi (argv[1]) : 100000;
+  printf ("%d entries\n", n);
+  int ok = run (n, 1);
+  ok = run (n, 0) && ok;
+  return ok ? 0 : 1;
+  }
+
@@ -0,0 +1,88 @@
+/*==========================================================================
+txt2epub
+bench/scan.c
+Measure the throughput of each implementation of kmsscan_find and
+kmsscan_present, on ASCII prose with the byte sets the formatter uses.
+Usage: scan [size_in_MB]
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kmsscan.h"
+
+static const char *prose = 
+  "It was a bright cold day in April, and the clocks were striking "
+  "thirteen. Winston Smith, his chin nuzzled into his breast in an effort "
+  "to escape the vile wind, slipped quickly through the glass doors of "
+  "Victory Mansions, though not quickly enough to prevent a swirl of "
+  "gritty dust from entering along with him.\n";
+
+/*==========================================================================
+now 
+*==========================================================================*/
+static double now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+/*==========================================================================
+main
+*==========================================================================*/
+int main (int argc, char **argv)
+  {
+  int mb = argc > 1 ? atoi (argv[1]) : 64;
+  size_t size = (size_t)mb << 20;
+  char *buff = malloc (size);
+  size_t plen = strlen (prose), i;
+  for (i = 0; i < size; i++)
+    buff[i] = prose[i % plen];
+
+  KMSScanSet fused, md;
+  kmsscan_set_init (&fused, "&<>\xC0`*_", 7);
+  kmsscan_set_init (&md, "*_#", 3);
+
+  const char *impls[] = { "scalar", "sse2", "avx2" };
+  int k;
+  for (k = 0; k < 3; k++)
+    {
+    if (!kmsscan_use (impls[k]))
+      {
+      printf ("%-7s not supported\n", impls[k]);
+      continue;
+      }
+
+    // Scan the buffer line by line, as the formatter does
+    double t = now ();
+    long found = 0;
+    size_t off = 0;
+    while (off < size)
+      {
+      int len = size - off < plen ? size - off : plen;
+      found += kmsscan_find (&fused, buff + off, len);
+      off += len;
+      }
+    double find_t = now () - t;
+
+    t = now ();
+    off = 0;
+    while (off < size)
+      {
+      int len = size - off < plen ? size - off : plen;
+      found += kmsscan_present (&md, buff + off, len);
+      off += len;
+      }
+    double present_t = now () - t;
+
+    printf ("%-7s find %6.2f GB/s, present %6.2f GB/s (%ld)\n", impls[k], 
+      size / find_t / 1e9, size / present_t / 1e9, found);
+    }
+
+  free (buff);
+  return 0;
+  }
+
@@ -0,0 +1,21 @@
+#!/usr/bin/bash
+# Time the conversion of single-line inputs that are dense with Markdown
+#  markers. The default verbatim marker uses the single-pass formatter;
+#  a marker that is a regular expression ([`]) forces every line through
+#  the regular expression substitutions, so both are timed.
+# Usage: subs.sh [size_in_MB]
+
+TXT2EPUB=${TXT2EPUB:-../txt2epub}
+MB=${1:-10}
+TMP=$(mktemp -d)
+TIMEFORMAT="%R s"
+
+yes 'Some *bold* text, some _italic_ text, an & and a `<b>`tag`</b>`. ' \
+  | head -c ${MB}M | tr -d '\n' > $TMP/dense.txt
+
+for marker in '`' '[`]'; do
+  echo -n "$MB MB single line, verbatim marker '$marker': "
+  time $TXT2EPUB --verbatim-marker "$marker" -o $TMP/dense.epub $TMP/dense.txt
+done
+
+rm -rf $TMP
@@ -0,0 +1,350 @@
+/*==========================================================================
+  txt2epub
+  cache.c
+  Converted chapters, kept on disk from one build to the next
+  Copyright (c)2024 Kevin Boone, GPL3.0
+==========================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "kmsconstants.h"
+#include "kmslogging.h"
+#include "kmsstring.h"
+#include "kmshash.h"
+#include "cache.h"
+
+// Each file starts with a CacheHeader, followed by the title, the format
+//  settings, and the compression settings (without terminating zeros),
+//  then the deflated XHTML, if any, and then the XHTML. The numbers are
+//  in whatever order the machine has them -- a cache is no use on
+//  another machine, anyway
+#define CACHE_MAGIC "txt2epub cache1"
+
+typedef struct _CacheHeader
+  {
+  char magic[16];
+  uint64_t hash;
+  uint64_t text_len;
+  uint64_t len;
+  uint64_t clen;
+  uint32_t crc;
+  uint32_t title_len;
+  uint32_t format_len;
+  uint32_t compression_len;
+  } CacheHeader;
+
+struct _Cache
+  {
+  char *dir;
+  char *format;
+  char *compression;
+  uint64_t seed;          // Hash of the program, and the format settings
+  };
+
+
+/*==========================================================================
+  cache_default_dir
+  $XDG_CACHE_HOME/txt2epub, or ~/.cache/txt2epub if that isn't set, as
+  the XDG base directory specification says. The caller must free the
+  result. Returns NULL if there is no home directory, either.
+==========================================================================*/
+char *cache_default_dir (void)
+  {
+  char *dir = NULL;
+  const char *xdg = getenv ("XDG_CACHE_HOME");
+  const char *home = getenv ("HOME");
+  // A relative path is invalid, and must be ignored
+  if (xdg && xdg[0] == '/')
+    asprintf (&dir, "%s/txt2epub", xdg);
+  else if (home && home[0])
+    asprintf (&dir, "%s/.cache/txt2epub", home);
+  return dir;
+  }
+
+
+/*==========================================================================
+  cache_mkdirs
+  Make a directory, and any of its parents that don't exist
+==========================================================================*/
+static BOOL cache_mkdirs (const char *dir)
+  {
+  char *path = strdup (dir);
+  char *p;
+  for (p = path + 1; *p; p++)
+    {
+    if (*p != '/') continue;
+    *p = 0;
+    mkdir (path, 0700);
+    *p = '/';
+    }
+  BOOL ret = mkdir (path, 0700) == 0 || errno == EEXIST;
+  free (path);
+  return ret;
+  }
+
+
+/*==========================================================================
+  cache_hash_program
+  A hash of the running program, so that a different build of txt2epub,
+  which might format text differently, does not use this one's files
+==========================================================================*/
+static uint64_t cache_hash_program (void)
+  {
+  uint64_t h = kmshash64_str (VERSION, 0);
+  int fd = open ("/proc/self/exe", O_RDONLY);
+  if (fd < 0) return h;
+  char *buff = malloc (65536);
+  ssize_t n;
+  while ((n = read (fd, buff, 65536)) > 0)
+    h = kmshash64 (buff, n, h);
+  free (buff);
+  close (fd);
+  return h;
+  }
+
+
+/*==========================================================================
+  cache_open
+  Use the cache in dir, making the directory if necessary. format is a
+  description of every setting that affects how text is formatted, and
+  compression of everything that affects how XHTML is compressed.
+  Returns NULL, having said why, if the directory can't be made.
+==========================================================================*/
+Cache *cache_open (const char *dir, const char *format,
+    const char *compression)
+  {
+  if (!cache_mkdirs (dir))
+    {
+    kmslog_warning ("Can't use cache %s: %s", dir, strerror (errno));
+    return NULL;
+    }
+  Cache *self = malloc (sizeof (Cache));
+  self->dir = strdup (dir);
+  self->format = strdup (format);
+  self->compression = strdup (compression);
+  self->seed = kmshash64_str (format, cache_hash_program ());
+  kmslog_debug ("Using cache %s", dir);
+  return self;
+  }
+
+
+/*==========================================================================
+  cache_close
+==========================================================================*/
+void cache_close (Cache *self)
+  {
+  free (self->dir);
+  free (self->format);
+  free (self->compression);
+  free (self);
+  }
+
+
+/*==========================================================================
+  cache_key
+  Work out the key for a chapter with the given text and title. The
+  title is not copied, so it must last as long as the key.
+==========================================================================*/
+void cache_key (const Cache *self, CacheKey *key, const char *text,
+    size_t len, const char *title, BOOL is_xhtml)
+  {
+  uint64_t h = kmshash64 (text, len, self->seed);
+  h = kmshash64_str (title, h);
+  key->hash = kmshash64 (is_xhtml ? "x" : "t", 1, h);
+  key->text_len = len;
+  key->title = title;
+  }
+
+
+/*==========================================================================
+  cache_path
+==========================================================================*/
+static char *cache_path (const Cache *self, const CacheKey *key)
+  {
+  char *path = NULL;
+  asprintf (&path, "%s/%016llx", self->dir, (unsigned long long)key->hash);
+  return path;
+  }
+
+
+/*==========================================================================
+  cache_read_all
+  Read exactly len bytes at offset off
+==========================================================================*/
+static BOOL cache_read_all (int fd, void *buff, size_t len, off_t off)
+  {
+  char *p = buff;
+  while (len > 0)
+    {
+    ssize_t n = pread (fd, p, len, off);
+    if (n <= 0)
+      {
+      if (n < 0 && errno == EINTR) continue;
+      return FALSE;
+      }
+    p += n;
+    off += n;
+    len -= n;
+    }
+  return TRUE;
+  }
+
+
+/*==========================================================================
+  cache_matches
+  Check that the strings after the header are what they should be, in
+  case two chapters, or two sets of settings, hash to the same value.
+  Sets same_compression if the deflated data is any use.
+==========================================================================*/
+static BOOL cache_matches (const Cache *self, int fd, const CacheHeader *h,
+    const CacheKey *key, BOOL *same_compression)
+  {
+  size_t title_len = strlen (key->title);
+  size_t format_len = strlen (self->format);
+  size_t comp_len = strlen (self->compression);
+  if (h->title_len != title_len || h->format_len != format_len
+       || h->compression_len > 4096)
+    return FALSE;
+  size_t n = h->title_len + h->format_len + h->compression_len;
+  char *s = malloc (n + 1);
+  BOOL ret = cache_read_all (fd, s, n, sizeof (CacheHeader))
+    && memcmp (s, key->title, title_len) == 0
+    && memcmp (s + title_len, self->format, format_len) == 0;
+  *same_compression = ret && h->compression_len == comp_len
+    && memcmp (s + title_len + format_len, self->compression,
+         comp_len) == 0;
+  free (s);
+  return ret;
+  }
+
+
+/*==========================================================================
+  cache_get
+  Look for a chapter in the cache. If it is there, fills in entry and
+  returns TRUE. If the compression settings are the same as when the
+  chapter was cached, the entry is complete, with either deflated data,
+  or the XHTML to be stored as it is; otherwise it has only the XHTML.
+==========================================================================*/
+BOOL cache_get (Cache *self, const CacheKey *key, CacheEntry *entry)
+  {
+  memset (entry, 0, sizeof (CacheEntry));
+  char *path = cache_path (self, key);
+  int fd = open (path, O_RDONLY);
+  free (path);
+  if (fd < 0) return FALSE;
+
+  CacheHeader h;
+  BOOL same_compression = FALSE;
+  BOOL ret = cache_read_all (fd, &h, sizeof (h), 0)
+    && memcmp (h.magic, CACHE_MAGIC, sizeof (h.magic)) == 0
+    && h.hash == key->hash && h.text_len == key->text_len
+    && h.len < INT_MAX
+    && cache_matches (self, fd, &h, key, &same_compression);
+  if (ret)
+    {
+    off_t off = sizeof (h) + h.title_len + h.format_len
+      + h.compression_len;
+    entry->len = h.len;
+    entry->crc = h.crc;
+    entry->complete = same_compression;
+    if (same_compression && h.clen > 0)
+      {
+      entry->deflated = malloc (h.clen);
+      entry->clen = h.clen;
+      ret = cache_read_all (fd, entry->deflated, h.clen, off);
+      }
+    else
+      {
+      entry->xhtml = kmsstring_create_empty ();
+      char *p = kmsstring_append_begin (entry->xhtml, h.len);
+      ret = cache_read_all (fd, p, h.len, off + h.clen);
+      kmsstring_append_end (entry->xhtml, ret ? h.len : 0);
+      }
+    if (!ret)
+      {
+      free (entry->deflated);
+      if (entry->xhtml) kmsstring_destroy (entry->xhtml);
+      memset (entry, 0, sizeof (CacheEntry));
+      }
+    }
+  close (fd);
+  return ret;
+  }
+
+
+/*==========================================================================
+  cache_write_all
+==========================================================================*/
+static BOOL cache_write_all (int fd, const void *buff, size_t len)
+  {
+  const char *p = buff;
+  while (len > 0)
+    {
+    ssize_t n = write (fd, p, len);
+    if (n < 0)
+      {
+      if (errno == EINTR) continue;
+      return FALSE;
+      }
+    p += n;
+    len -= n;
+    }
+  return TRUE;
+  }
+
+
+/*==========================================================================
+  cache_put
+  Add a chapter to the cache, or replace it. The entry must have the
+  XHTML, and the deflated form of it, unless it is to be stored as it
+  is. A failure to write is not an error -- the chapter just won't be
+  cached.
+==========================================================================*/
+void cache_put (Cache *self, const CacheKey *key, const CacheEntry *entry)
+  {
+  CacheHeader h;
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, CACHE_MAGIC, sizeof (h.magic));
+  h.hash = key->hash;
+  h.text_len = key->text_len;
+  h.len = entry->len;
+  h.clen = entry->deflated ? entry->clen : 0;
+  h.crc = entry->crc;
+  h.title_len = strlen (key->title);
+  h.format_len = strlen (self->format);
+  h.compression_len = strlen (self->compression);
+
+  // Another process might be reading the file under its real name, or
+  //  writing it under a temporary name of its own
+  char *path = cache_path (self, key);
+  char *temp = NULL;
+  asprintf (&temp, "%s.XXXXXX", path);
+  int fd = mkstemp (temp);
+  if (fd >= 0)
+    {
+    BOOL ok = cache_write_all (fd, &h, sizeof (h))
+      && cache_write_all (fd, key->title, h.title_len)
+      && cache_write_all (fd, self->format, h.format_len)
+      && cache_write_all (fd, self->compression, h.compression_len)
+      && cache_write_all (fd, entry->deflated, h.clen)
+      && cache_write_all (fd, kmsstring_cstr (entry->xhtml), h.len);
+    if (close (fd) != 0) ok = FALSE;
+    if (ok && rename (temp, path) == 0)
+      kmslog_debug ("Cached %s as %s", key->title, path);
+    else
+      {
+      kmslog_debug ("Can't write cache file %s: %s", path,
+        strerror (errno));
+      unlink (temp);
+      }
+    }
+  free (temp);
+  free (path);
+  }
+
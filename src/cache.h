@@ -0,0 +1,70 @@
+/*==========================================================================
+txt2epub
+cache.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kmsconstants.h"
+#include "kmsstring.h"
+
+// A Cache keeps each chapter that has been converted, formatted and
+//  compressed, in a file of its own in a directory, so that the next
+//  build of the same book can use it as it is. A chapter is found by
+//  a hash of its text, its title, every setting that affects how it is
+//  formatted, and the txt2epub program itself, so that nothing can
+//  make a cached chapter out of date without giving it a different
+//  name.
+//
+// The compressed form is only any use with the same compression
+//  settings; with other settings, cache_get gives just the XHTML, to
+//  be compressed again.
+//
+// Any number of threads, and of processes, can use the same cache at
+//  once. Files are written under temporary names, and renamed when
+//  they are complete. Nothing is ever removed; the directory can be
+//  emptied at any time.
+
+struct _Cache;
+typedef struct _Cache Cache;
+
+typedef struct _CacheKey
+  {
+  uint64_t hash;          // Of all of the below, and the settings
+  uint64_t text_len;
+  const char *title;
+  } CacheKey;
+
+typedef struct _CacheEntry
+  {
+  KMSString *xhtml;       // NULL if only deflated was read
+  void *deflated;         // NULL if the XHTML is stored uncompressed
+  size_t clen;
+  size_t len;             // Of the XHTML
+  uint32_t crc;           // Of the XHTML
+  BOOL complete;          // FALSE if the XHTML needs compressing
+  } CacheEntry;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+char         *cache_default_dir (void);
+Cache        *cache_open (const char *dir, const char *format,
+                const char *compression);
+void         cache_close (Cache *self);
+void         cache_key (const Cache *self, CacheKey *key,
+                const char *text, size_t len, const char *title,
+                BOOL is_xhtml);
+BOOL         cache_get (Cache *self, const CacheKey *key,
+                CacheEntry *entry);
+void         cache_put (Cache *self, const CacheKey *key,
+                const CacheEntry *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
@@ -20,6 +20,17 @@
 #include "kmsstring.h" 
 #include "kmslist.h" 
 
+// A book can have a hundred thousand chapters, and the manifest, spine,
+//  and navMap all have an entry for each one. So each buffer is made
+//  big enough for everything at the start, and entries are put together
+//  from pieces, rather than by printf(), which takes several times
+//  longer
+#define EPUB_APPEND(xml, lit) kmsstring_append_n ((xml), lit, sizeof (lit) - 1)
+
+// Room for the fixed parts of an entry, and its numbers
+#define EPUB_NAVPOINT_SIZE 160
+#define EPUB_ITEM_SIZE 128
+
 
 /*==========================================================================
   get_mime_type_by_extention 
@@ -59,6 +70,12 @@ char *epub_make_toc_ncx (KMSList *ch_list, const char *book_title, long pid,
 
   KMSString *xml = kmsstring_create_empty();
 
+  int i, l = kmslist_length_unlocked (ch_list);
+  size_t size = 1024 + strlen (book_title);
+  for (i = 0; i < l; i++)
+    size += EPUB_NAVPOINT_SIZE + strlen (kmslist_get_unlocked (ch_list, i));
+  kmsstring_reserve (xml, size);
+
   kmsstring_append (xml, "<?xml version=\"1.0\"  encoding=\"UTF-8\"?>\n");
   kmsstring_append (xml, "<ncx version=\"2005-1\" "
      "xml:lang=\"en\" xmlns=\"http://www.daisy.org/z3986/2005/ncx/\">\n");
@@ -73,28 +90,27 @@ char *epub_make_toc_ncx (KMSList *ch_list, const char *book_title, long pid,
 
   kmsstring_append (xml, "<navMap>\n");
 
-  int i, l = kmslist_length (ch_list);
   for (i = 0; i < l; i++)
     {
-    const char *ch_name = kmslist_get (ch_list, i);
-    kmsstring_append_printf (xml, "<navPoint id=\"txt2epub-%d-%ld\" "
-      "playOrder=\"%d\" >\n", time(NULL), rand(), i + 1);
-    kmsstring_append (xml, "<navLabel>\n");
-    kmsstring_append (xml, "<text>\n");
-    kmsstring_append_printf (xml, "%s", ch_name);
-    kmsstring_append (xml, "</text>\n");
-    kmsstring_append (xml, "</navLabel>\n");
-    kmsstring_append_printf (xml, "<content src=\"file%d.html\"/>\n", i); 
-    kmsstring_append (xml, "</navPoint>\n");
+    const char *ch_name = kmslist_get_unlocked (ch_list, i);
+    EPUB_APPEND (xml, "<navPoint id=\"txt2epub-");
+    kmsstring_append_long (xml, tim);
+    EPUB_APPEND (xml, "-");
+    kmsstring_append_long (xml, i);
+    EPUB_APPEND (xml, "\" playOrder=\"");
+    kmsstring_append_long (xml, i + 1);
+    EPUB_APPEND (xml, "\" >\n<navLabel>\n<text>\n");
+    kmsstring_append (xml, ch_name);
+    EPUB_APPEND (xml, "</text>\n</navLabel>\n<content src=\"file");
+    kmsstring_append_long (xml, i);
+    EPUB_APPEND (xml, ".html\"/>\n</navPoint>\n");
     }
 
   kmsstring_append (xml, "</navMap>\n");
 
   kmsstring_append (xml, "</ncx>\n");
 
-  char *ss = strdup (kmsstring_cstr (xml));
-  kmsstring_destroy (xml);
-  return ss; 
+  return kmsstring_detach (xml);
   }
 
 /*==========================================================================
@@ -109,6 +125,10 @@ char *epub_make_content_opf (const int files, const char *title,
   if (!language) language = "en";
 
   KMSString *xml = kmsstring_create_empty();
+  size_t size = 2048 + strlen (title) + strlen (language) 
+    + 2 * strlen (author) + (cover_basename ? strlen (cover_basename) : 0)
+    + (size_t)files * EPUB_ITEM_SIZE;
+  kmsstring_reserve (xml, size);
 
   kmsstring_append (xml, "<?xml version=\"1.0\"  encoding=\"UTF-8\"?>\n");
   kmsstring_append (xml, "<package xmlns=\"http://www.idpf.org/2007/opf\" "
@@ -141,9 +161,11 @@ char *epub_make_content_opf (const int files, const char *title,
   int i;
   for (i = 0; i < files; i++)
     {
-    kmsstring_append_printf (xml, 
-      "<item href=\"file%d.html\" id=\"file%d\" media-type=\"application/xhtml+xml\"/>\n", 
-      i, i); 
+    EPUB_APPEND (xml, "<item href=\"file");
+    kmsstring_append_long (xml, i);
+    EPUB_APPEND (xml, ".html\" id=\"file");
+    kmsstring_append_long (xml, i);
+    EPUB_APPEND (xml, "\" media-type=\"application/xhtml+xml\"/>\n");
     }
   kmsstring_append (xml, "<item href=\"toc.ncx\" "
     "media-type=\"application/x-dtbncx+xml\" id=\"ncx\"/>\n");
@@ -157,15 +179,15 @@ char *epub_make_content_opf (const int files, const char *title,
     }
   for (i = 0; i < files; i++)
     {
-    kmsstring_append_printf  (xml, "<itemref idref=\"file%d\"/>\n", i);
+    EPUB_APPEND (xml, "<itemref idref=\"file");
+    kmsstring_append_long (xml, i);
+    EPUB_APPEND (xml, "\"/>\n");
     }
   kmsstring_append (xml, "</spine>\n"); 
   kmsstring_append (xml, "</package>\n"); 
 
 
-  char *ss = strdup (kmsstring_cstr (xml));
-  kmsstring_destroy (xml);
-  return ss; 
+  return kmsstring_detach (xml);
   }
 
 /*==========================================================================
@@ -202,9 +224,7 @@ char *epub_make_cover (const char *cover_image)
   kmsstring_append (xml, "</body>\n");
   kmsstring_append (xml, "</html>\n");
 
-  char *ss = strdup (kmsstring_cstr (xml));
-  kmsstring_destroy (xml);
-  return ss; 
+  return kmsstring_detach (xml);
 
   }
 
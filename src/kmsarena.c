@@ -0,0 +1,136 @@
+/*==========================================================================
+txt2epub
+kmsarena.c
+A simple arena ('bump') allocator
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include "kmsarena.h"
+
+// Every allocation is rounded up to this, so that anything can be 
+//  stored in it
+#define KMSARENA_ALIGN 16
+
+typedef struct _KMSArenaBlock
+  {
+  struct _KMSArenaBlock *next;
+  size_t size;                // Usable bytes in data
+  char *data;
+  } KMSArenaBlock;
+
+// The data follows the block header, which is padded so that the data 
+//  starts on a KMSARENA_ALIGN boundary, as malloc's result does
+#define KMSARENA_HEADER \
+  ((sizeof (KMSArenaBlock) + KMSARENA_ALIGN - 1) \
+    & ~(size_t)(KMSARENA_ALIGN - 1))
+
+struct _KMSArena
+  {
+  size_t block_size;
+  KMSArenaBlock *first;
+  KMSArenaBlock *current;     // The block we're allocating from
+  size_t used;                // Bytes used in current
+  };
+
+
+/*==========================================================================
+kmsarena_new_block
+*==========================================================================*/
+static KMSArenaBlock *kmsarena_new_block (size_t size)
+  {
+  KMSArenaBlock *block = malloc (KMSARENA_HEADER + size);
+  block->next = NULL;
+  block->size = size;
+  block->data = (char *)block + KMSARENA_HEADER;
+  return block;
+  }
+
+
+/*==========================================================================
+kmsarena_create
+*==========================================================================*/
+KMSArena *kmsarena_create (size_t block_size)
+  {
+  KMSArena *self = malloc (sizeof (KMSArena));
+  self->block_size = block_size;
+  self->first = kmsarena_new_block (block_size);
+  self->current = self->first;
+  self->used = 0;
+  return self;
+  }
+
+
+/*==========================================================================
+kmsarena_destroy
+*==========================================================================*/
+void kmsarena_destroy (KMSArena *self)
+  {
+  if (!self) return;
+  KMSArenaBlock *b = self->first;
+  while (b)
+    {
+    KMSArenaBlock *next = b->next;
+    free (b);
+    b = next;
+    }
+  free (self);
+  }
+
+
+/*==========================================================================
+kmsarena_alloc
+Returns size bytes that remain valid until the arena is reset to a mark 
+taken before this call, or destroyed. If the current block is full, we
+move on to the next one, if a previous reset left one that is big
+enough. Otherwise a new block is inserted after the current one. 
+Allocations larger than the block size get a block of their own.
+*==========================================================================*/
+void *kmsarena_alloc (KMSArena *self, size_t size)
+  {
+  size = (size + KMSARENA_ALIGN - 1) & ~(size_t)(KMSARENA_ALIGN - 1);
+  if (self->used + size > self->current->size)
+    {
+    KMSArenaBlock *next = self->current->next;
+    if (!next || next->size < size)
+      {
+      size_t block_size = size > self->block_size ? size : self->block_size;
+      KMSArenaBlock *block = kmsarena_new_block (block_size);
+      block->next = next;
+      self->current->next = block;
+      next = block;
+      }
+    self->current = next;
+    self->used = 0;
+    }
+  void *ret = self->current->data + self->used;
+  self->used += size;
+  return ret;
+  }
+
+
+/*==========================================================================
+kmsarena_mark
+*==========================================================================*/
+KMSArenaMark kmsarena_mark (const KMSArena *self)
+  {
+  KMSArenaMark mark;
+  mark.block = self->current;
+  mark.used = self->used;
+  return mark;
+  }
+
+
+/*==========================================================================
+kmsarena_reset
+Release everything allocated since mark was taken. The blocks are kept,
+for later allocations to reuse.
+*==========================================================================*/
+void kmsarena_reset (KMSArena *self, KMSArenaMark mark)
+  {
+  self->current = mark.block;
+  self->used = mark.used;
+  }
+
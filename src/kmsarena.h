@@ -0,0 +1,44 @@
+/*==========================================================================
+txt2epub
+kmsarena.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "kmsconstants.h"
+
+// A KMSArena is a 'bump' allocator: memory is handed out from large 
+//  blocks simply by advancing a pointer, and is never freed piecemeal. 
+//  Instead, the arena can be reset to a mark, which releases everything
+//  allocated since the mark was taken, or destroyed, which releases
+//  everything. Blocks are kept for reuse after a reset, so an arena that
+//  is repeatedly reset settles down to not calling malloc at all. An
+//  arena is not thread-safe -- each thread should have its own.
+
+struct _KMSArena;
+typedef struct _KMSArena KMSArena;
+
+struct _KMSArenaBlock;
+
+typedef struct _KMSArenaMark
+  {
+  struct _KMSArenaBlock *block;
+  size_t used;
+  } KMSArenaMark;
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+KMSArena     *kmsarena_create (size_t block_size);
+void         kmsarena_destroy (KMSArena *self);
+void         *kmsarena_alloc (KMSArena *self, size_t size);
+KMSArenaMark kmsarena_mark (const KMSArena *self);
+void         kmsarena_reset (KMSArena *self, KMSArenaMark mark);
+
+#ifdef __cplusplus 
+}
+#endif
+
@@ -0,0 +1,330 @@
+/*==========================================================================
+txt2epub
+kmscrc.c
+CRC-32, using carry-less multiplication where the processor has it
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "kmscrc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KMSCRC_X86 1
+#include <immintrin.h>
+#endif
+
+// The CRC-32 polynomial, bit-reversed
+#define KMSCRC_POLY 0xEDB88320u
+
+typedef uint32_t (*KMSCrcFn) (uint32_t crc, const unsigned char *p,
+   size_t len);
+
+static uint32_t kmscrc_update_first (uint32_t crc, const unsigned char *p,
+   size_t len);
+
+static uint32_t crc_table[8][256];
+static KMSCrcFn crc_fn = kmscrc_update_first;
+static const char *impl_name = "table";
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+/*==========================================================================
+kmscrc_make_tables
+crc_table[0] is the usual byte-at-a-time table. crc_table[k] gives the
+effect of a byte followed by k zero bytes, so eight bytes can be looked
+up at once.
+*==========================================================================*/
+static void kmscrc_make_tables (void)
+  {
+  uint32_t n, k, c;
+  for (n = 0; n < 256; n++)
+    {
+    c = n;
+    for (k = 0; k < 8; k++)
+      c = c & 1 ? KMSCRC_POLY ^ (c >> 1) : c >> 1;
+    crc_table[0][n] = c;
+    }
+  for (n = 0; n < 256; n++)
+    {
+    c = crc_table[0][n];
+    for (k = 1; k < 8; k++)
+      {
+      c = crc_table[0][c & 0xFF] ^ (c >> 8);
+      crc_table[k][n] = c;
+      }
+    }
+  }
+
+
+/*==========================================================================
+kmscrc_update_table
+One byte at a time. Like all the implementations, this works on the
+inverted CRC, as the algorithm needs
+*==========================================================================*/
+static uint32_t kmscrc_update_table (uint32_t crc, const unsigned char *p,
+    size_t len)
+  {
+  crc = ~crc;
+  while (len--)
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+  }
+
+
+/*==========================================================================
+kmscrc_update_slice8
+Eight bytes at a time, with eight tables ('slicing-by-8'). The loads
+assume a little-endian processor; on others, this is just the table
+version
+*==========================================================================*/
+static uint32_t kmscrc_update_slice8 (uint32_t crc, const unsigned char *p,
+    size_t len)
+  {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  crc = ~crc;
+  while (len > 0 && ((uintptr_t)p & 7))
+    {
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    len--;
+    }
+  while (len >= 8)
+    {
+    uint32_t a, b;
+    memcpy (&a, p, 4);
+    memcpy (&b, p + 4, 4);
+    a ^= crc;
+    crc = crc_table[7][a & 0xFF] ^ crc_table[6][(a >> 8) & 0xFF]
+      ^ crc_table[5][(a >> 16) & 0xFF] ^ crc_table[4][a >> 24]
+      ^ crc_table[3][b & 0xFF] ^ crc_table[2][(b >> 8) & 0xFF]
+      ^ crc_table[1][(b >> 16) & 0xFF] ^ crc_table[0][b >> 24];
+    p += 8;
+    len -= 8;
+    }
+  while (len--)
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+#else
+  return kmscrc_update_table (crc, p, len);
+#endif
+  }
+
+
+#ifdef KMSCRC_X86
+
+/*==========================================================================
+kmscrc_fold_pclmul
+The folding method from Gopal et al., "Fast CRC Computation for Generic
+Polynomials Using PCLMULQDQ Instruction" (Intel, 2009), with the
+bit-reflected constants from the end of that paper, as used by
+Chromium's zlib. Four 128-bit accumulators take 64 bytes at a time,
+and are then folded into one, which takes any further 16-byte blocks;
+what is left is reduced to 32 bits. len must be at least 64, and a
+multiple of 16. crc is inverted, as in the table versions.
+*==========================================================================*/
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t kmscrc_fold_pclmul (uint32_t crc, const unsigned char *p,
+    size_t len)
+  {
+  static const uint64_t k1k2[] __attribute__((aligned(16))) =
+    { 0x0154442bd4, 0x01c6e41596 };
+  static const uint64_t k3k4[] __attribute__((aligned(16))) =
+    { 0x01751997d0, 0x00ccaa009e };
+  static const uint64_t k5k0[] __attribute__((aligned(16))) =
+    { 0x0163cd6124, 0x0000000000 };
+  static const uint64_t poly[] __attribute__((aligned(16))) =
+    { 0x01db710641, 0x01f7011641 };
+
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128 ((const __m128i *)(p + 0x00));
+  x2 = _mm_loadu_si128 ((const __m128i *)(p + 0x10));
+  x3 = _mm_loadu_si128 ((const __m128i *)(p + 0x20));
+  x4 = _mm_loadu_si128 ((const __m128i *)(p + 0x30));
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (crc));
+  x0 = _mm_load_si128 ((const __m128i *)k1k2);
+  p += 64;
+  len -= 64;
+
+  // Fold 64 bytes at a time into the four accumulators
+  while (len >= 64)
+    {
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+
+    y5 = _mm_loadu_si128 ((const __m128i *)(p + 0x00));
+    y6 = _mm_loadu_si128 ((const __m128i *)(p + 0x10));
+    y7 = _mm_loadu_si128 ((const __m128i *)(p + 0x20));
+    y8 = _mm_loadu_si128 ((const __m128i *)(p + 0x30));
+
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), y5);
+    x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), y6);
+    x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), y7);
+    x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), y8);
+
+    p += 64;
+    len -= 64;
+    }
+
+  // Fold the four accumulators into one
+  x0 = _mm_load_si128 ((const __m128i *)k3k4);
+
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+  x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+  // Then 16 bytes at a time
+  while (len >= 16)
+    {
+    x2 = _mm_loadu_si128 ((const __m128i *)p);
+    x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+    x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+    p += 16;
+    len -= 16;
+    }
+
+  // 128 bits to 64
+  x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+  x3 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  x1 = _mm_srli_si128 (x1, 8);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  x0 = _mm_loadl_epi64 ((const __m128i *)k5k0);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, x3);
+  x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128 ((const __m128i *)poly);
+  x2 = _mm_and_si128 (x1, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+  x2 = _mm_and_si128 (x2, x3);
+  x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+
+  return _mm_extract_epi32 (x1, 1);
+  }
+
+
+/*==========================================================================
+kmscrc_update_pclmul
+Fold as many 16-byte blocks as possible, and do the rest with tables
+*==========================================================================*/
+static uint32_t kmscrc_update_pclmul (uint32_t crc, const unsigned char *p,
+    size_t len)
+  {
+  if (len < 64)
+    return kmscrc_update_slice8 (crc, p, len);
+  size_t n = len & ~(size_t)15;
+  crc = ~kmscrc_fold_pclmul (~crc, p, n);
+  return kmscrc_update_slice8 (crc, p + n, len - n);
+  }
+
+#endif
+
+
+/*==========================================================================
+kmscrc_use
+Select an implementation by name: "table", "slice8", or "pclmul".
+Returns FALSE, and changes nothing, if the processor doesn't support
+it. This is mostly for testing and benchmarking -- kmscrc_init picks
+the best one available.
+*==========================================================================*/
+BOOL kmscrc_use (const char *impl)
+  {
+  pthread_once (&init_once, kmscrc_make_tables);
+  if (strcmp (impl, "table") == 0)
+    crc_fn = kmscrc_update_table;
+  else if (strcmp (impl, "slice8") == 0)
+    crc_fn = kmscrc_update_slice8;
+#ifdef KMSCRC_X86
+  else if (strcmp (impl, "pclmul") == 0
+       && __builtin_cpu_supports ("pclmul")
+       && __builtin_cpu_supports ("sse4.1"))
+    crc_fn = kmscrc_update_pclmul;
+#endif
+  else
+    return FALSE;
+  impl_name = impl;
+  return TRUE;
+  }
+
+
+/*==========================================================================
+kmscrc_init
+Choose the fastest implementation the processor supports. This is done
+anyway the first time a CRC is worked out, but it's tidier to call it
+before starting any threads.
+*==========================================================================*/
+void kmscrc_init (void)
+  {
+#ifdef KMSCRC_X86
+  __builtin_cpu_init ();
+#endif
+  if (!kmscrc_use ("pclmul"))
+    kmscrc_use ("slice8");
+  }
+
+
+/*==========================================================================
+kmscrc_update_first
+crc_fn until kmscrc_init is called
+*==========================================================================*/
+static uint32_t kmscrc_update_first (uint32_t crc, const unsigned char *p,
+    size_t len)
+  {
+  kmscrc_init ();
+  return crc_fn (crc, p, len);
+  }
+
+
+/*==========================================================================
+kmscrc_impl
+*==========================================================================*/
+const char *kmscrc_impl (void)
+  {
+  return impl_name;
+  }
+
+
+/*==========================================================================
+kmscrc_update
+Add len bytes of data to crc, which is the CRC of whatever came before,
+or 0
+*==========================================================================*/
+uint32_t kmscrc_update (uint32_t crc, const void *data, size_t len)
+  {
+  return crc_fn (crc, data, len);
+  }
+
+
+/*==========================================================================
+kmscrc_combine
+The CRC of two pieces of data, one after the other, given the CRC of
+each, and the length of the second
+*==========================================================================*/
+uint32_t kmscrc_combine (uint32_t crc1, uint32_t crc2, size_t len2)
+  {
+  return crc32_combine (crc1, crc2, len2);
+  }
+
@@ -0,0 +1,36 @@
+/*==========================================================================
+txt2epub
+kmscrc.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kmsconstants.h"
+
+// The CRC-32 that ZIP uses (the same one as zlib's crc32, and not the
+//  CRC-32C that the SSE4.2 crc32 instruction works out). On x86
+//  processors with PCLMULQDQ, 64 bytes at a time are folded into the
+//  result with carry-less multiplication; otherwise eight tables are
+//  used to do eight bytes at a time. The choice is made when kmscrc_init
+//  is called, or on first use.
+//
+// As with zlib, the CRC of no data is 0, and kmscrc_update carries on
+//  from the CRC of whatever came before.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void         kmscrc_init (void);
+BOOL         kmscrc_use (const char *impl);
+const char   *kmscrc_impl (void);
+uint32_t     kmscrc_update (uint32_t crc, const void *data, size_t len);
+uint32_t     kmscrc_combine (uint32_t crc1, uint32_t crc2, size_t len2);
+
+#ifdef __cplusplus
+}
+#endif
+
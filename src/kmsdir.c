@@ -0,0 +1,157 @@
+/*==========================================================================
+txt2epub
+kmsdir.c
+The files in a directory, in natural order
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "kmsdir.h"
+
+// The amount of directory we try to read at once. An entry takes about
+//  24 bytes plus its name, so this is several thousand entries per
+//  system call
+#define KMSDIR_READ_SIZE (256 * 1024)
+
+/*==========================================================================
+kmsdir_is_dir
+==========================================================================*/
+BOOL kmsdir_is_dir (const char *path)
+  {
+  struct stat sb;
+  return stat (path, &sb) == 0 && S_ISDIR (sb.st_mode);
+  }
+
+
+/*==========================================================================
+kmsdir_natural_compare
+Compare two strings as strcmp does, except that runs of digits are
+compared by their value. Strings that are the same apart from leading
+zeros are compared by strcmp, so that the order is always the same.
+==========================================================================*/
+int kmsdir_natural_compare (const char *a, const char *b)
+  {
+  const unsigned char *p = (const unsigned char *)a;
+  const unsigned char *q = (const unsigned char *)b;
+  while (*p && *q)
+    {
+    if (*p >= '0' && *p <= '9' && *q >= '0' && *q <= '9')
+      {
+      while (*p == '0') p++;
+      while (*q == '0') q++;
+      const unsigned char *p0 = p, *q0 = q;
+      while (*p >= '0' && *p <= '9') p++;
+      while (*q >= '0' && *q <= '9') q++;
+      // A longer number, without its leading zeros, is bigger
+      if (p - p0 != q - q0) return (p - p0) < (q - q0) ? -1 : 1;
+      int c = memcmp (p0, q0, p - p0);
+      if (c) return c;
+      }
+    else if (*p != *q)
+      return *p < *q ? -1 : 1;
+    else
+      {
+      p++;
+      q++;
+      }
+    }
+  if (*p || *q) return *p ? 1 : -1;
+  return strcmp (a, b);
+  }
+
+
+/*==========================================================================
+kmsdir_compare_paths
+For qsort
+==========================================================================*/
+static int kmsdir_compare_paths (const void *a, const void *b)
+  {
+  return kmsdir_natural_compare (*(char * const *)a, *(char * const *)b);
+  }
+
+
+/*==========================================================================
+kmsdir_is_file
+Whether a directory entry is a regular file, or a link to one. Most
+filesystems say what the entry is; for the rest, it has to be looked up
+==========================================================================*/
+static BOOL kmsdir_is_file (int fd, const struct dirent64 *d)
+  {
+  if (d->d_type == DT_REG) return TRUE;
+  if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) return FALSE;
+  struct stat sb;
+  return fstatat (fd, d->d_name, &sb, 0) == 0 && S_ISREG (sb.st_mode);
+  }
+
+
+/*==========================================================================
+kmsdir_list_files
+Returns FALSE, with errno set, if the directory can't be read, in which
+case nothing is added to the list
+==========================================================================*/
+BOOL kmsdir_list_files (const char *dir, KMSList *list)
+  {
+  int fd = open (dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) return FALSE;
+
+  // "dir/" is the same for every path, so it doesn't affect the order
+  size_t dlen = strlen (dir);
+  while (dlen > 1 && dir[dlen - 1] == '/') dlen--;
+  BOOL slash = dir[dlen - 1] != '/';
+
+  char *buff = malloc (KMSDIR_READ_SIZE);
+  char **paths = NULL;
+  size_t count = 0, cap = 0;
+  BOOL ret = TRUE;
+  ssize_t n;
+  while ((n = getdents64 (fd, buff, KMSDIR_READ_SIZE)) > 0)
+    {
+    ssize_t off = 0;
+    while (off < n)
+      {
+      const struct dirent64 *d = (const struct dirent64 *)(buff + off);
+      off += d->d_reclen;
+      if (d->d_name[0] == '.' || !kmsdir_is_file (fd, d)) continue;
+      if (count == cap)
+        {
+        cap = cap ? cap * 2 : 64;
+        paths = realloc (paths, cap * sizeof (char *));
+        }
+      size_t nlen = strlen (d->d_name);
+      char *path = malloc (dlen + slash + nlen + 1);
+      memcpy (path, dir, dlen);
+      if (slash) path[dlen] = '/';
+      memcpy (path + dlen + slash, d->d_name, nlen + 1);
+      paths[count++] = path;
+      }
+    }
+  if (n < 0) ret = FALSE;
+  int e = errno;
+  free (buff);
+  close (fd);
+
+  size_t i;
+  if (ret)
+    {
+    qsort (paths, count, sizeof (char *), kmsdir_compare_paths);
+    for (i = 0; i < count; i++)
+      kmslist_append (list, paths[i]);
+    }
+  else
+    {
+    for (i = 0; i < count; i++)
+      free (paths[i]);
+    }
+  free (paths);
+  errno = e;
+  return ret;
+  }
+
@@ -0,0 +1,33 @@
+/*==========================================================================
+txt2epub
+kmsdir.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include "kmsconstants.h"
+#include "kmslist.h"
+
+// kmsdir_list_files appends the path of every regular file in a
+//  directory to a list of strings, in natural order, so that
+//  "chapter2.txt" comes before "chapter10.txt". Hidden files, whose
+//  names start with a dot, and subdirectories are left out. Symbolic
+//  links are followed.
+//
+// The directory is read with getdents64, many entries at a time, rather
+//  than one readdir() at a time, because a book can have a hundred
+//  thousand chapters.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+BOOL         kmsdir_list_files (const char *dir, KMSList *list);
+BOOL         kmsdir_is_dir (const char *path);
+int          kmsdir_natural_compare (const char *a, const char *b);
+
+#ifdef __cplusplus
+}
+#endif
+
@@ -0,0 +1,141 @@
+/*==========================================================================
+txt2epub
+kmshash.c
+XXH64, a fast non-cryptographic hash
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <string.h>
+#include "kmshash.h"
+
+#define KMSHASH_P1 0x9E3779B185EBCA87ULL
+#define KMSHASH_P2 0xC2B2AE3D27D4EB4FULL
+#define KMSHASH_P3 0x165667B19E3779F9ULL
+#define KMSHASH_P4 0x85EBCA77C2B2AE63ULL
+#define KMSHASH_P5 0x27D4EB2F165667C5ULL
+
+
+/*==========================================================================
+kmshash_rotl, kmshash_read64, kmshash_read32
+The data is taken to be little-endian, whatever the platform, so the
+hash of the same data is the same everywhere
+*==========================================================================*/
+static inline uint64_t kmshash_rotl (uint64_t v, int n)
+  {
+  return (v << n) | (v >> (64 - n));
+  }
+
+static inline uint64_t kmshash_read64 (const unsigned char *p)
+  {
+  uint64_t v;
+  memcpy (&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64 (v);
+#endif
+  return v;
+  }
+
+static inline uint32_t kmshash_read32 (const unsigned char *p)
+  {
+  uint32_t v;
+  memcpy (&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32 (v);
+#endif
+  return v;
+  }
+
+
+/*==========================================================================
+kmshash_round, kmshash_merge
+*==========================================================================*/
+static inline uint64_t kmshash_round (uint64_t acc, uint64_t v)
+  {
+  acc += v * KMSHASH_P2;
+  return kmshash_rotl (acc, 31) * KMSHASH_P1;
+  }
+
+static inline uint64_t kmshash_merge (uint64_t h, uint64_t v)
+  {
+  h ^= kmshash_round (0, v);
+  return h * KMSHASH_P1 + KMSHASH_P4;
+  }
+
+
+/*==========================================================================
+kmshash64
+The XXH64 hash of len bytes of data. Four independent accumulators take
+32 bytes at a time, which keeps the multipliers busy
+*==========================================================================*/
+uint64_t kmshash64 (const void *data, size_t len, uint64_t seed)
+  {
+  const unsigned char *p = data, *end = p + len;
+  uint64_t h;
+
+  if (len >= 32)
+    {
+    uint64_t v1 = seed + KMSHASH_P1 + KMSHASH_P2;
+    uint64_t v2 = seed + KMSHASH_P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - KMSHASH_P1;
+    const unsigned char *limit = end - 32;
+    do
+      {
+      v1 = kmshash_round (v1, kmshash_read64 (p));
+      v2 = kmshash_round (v2, kmshash_read64 (p + 8));
+      v3 = kmshash_round (v3, kmshash_read64 (p + 16));
+      v4 = kmshash_round (v4, kmshash_read64 (p + 24));
+      p += 32;
+      } while (p <= limit);
+    h = kmshash_rotl (v1, 1) + kmshash_rotl (v2, 7)
+      + kmshash_rotl (v3, 12) + kmshash_rotl (v4, 18);
+    h = kmshash_merge (h, v1);
+    h = kmshash_merge (h, v2);
+    h = kmshash_merge (h, v3);
+    h = kmshash_merge (h, v4);
+    }
+  else
+    h = seed + KMSHASH_P5;
+
+  h += len;
+
+  // Then whatever is left over
+  while (p + 8 <= end)
+    {
+    h ^= kmshash_round (0, kmshash_read64 (p));
+    h = kmshash_rotl (h, 27) * KMSHASH_P1 + KMSHASH_P4;
+    p += 8;
+    }
+  if (p + 4 <= end)
+    {
+    h ^= (uint64_t)kmshash_read32 (p) * KMSHASH_P1;
+    h = kmshash_rotl (h, 23) * KMSHASH_P2 + KMSHASH_P3;
+    p += 4;
+    }
+  while (p < end)
+    {
+    h ^= *p++ * KMSHASH_P5;
+    h = kmshash_rotl (h, 11) * KMSHASH_P1;
+    }
+
+  // Make every bit of the result depend on every bit of the input
+  h ^= h >> 33;
+  h *= KMSHASH_P2;
+  h ^= h >> 29;
+  h *= KMSHASH_P3;
+  h ^= h >> 32;
+  return h;
+  }
+
+
+/*==========================================================================
+kmshash64_str
+The hash of a string, including its terminating zero, so that strings
+hashed one after another, each with the last hash as its seed, can't
+run together
+*==========================================================================*/
+uint64_t kmshash64_str (const char *s, uint64_t seed)
+  {
+  return kmshash64 (s, strlen (s) + 1, seed);
+  }
+
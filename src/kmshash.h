@@ -0,0 +1,27 @@
+/*==========================================================================
+txt2epub
+kmshash.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A fast 64-bit hash, for telling data apart, not for security: this is
+//  XXH64, by Yann Collet, and gives the same values as the reference
+//  implementation. Hashes can be chained, by passing one as the seed
+//  of the next.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t     kmshash64 (const void *data, size_t len, uint64_t seed);
+uint64_t     kmshash64_str (const char *s, uint64_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+
@@ -0,0 +1,402 @@
+/*==========================================================================
+txt2epub
+kmsinput.c
+Line-at-a-time input from a memory-mapped file, or a buffered stream
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "kmsscan.h"
+#include "kmsinput.h"
+
+// The amount we try to read at once, when the input can't be mapped
+#define KMSINPUT_READ_SIZE 65536
+
+// Files smaller than this are read into a buffer in one go, rather than
+//  mapped. Setting up a mapping and tearing it down again costs more than
+//  copying this much, and a book may have thousands of small chapters
+#define KMSINPUT_MAP_MIN 65536
+
+// Lines longer than this are handed out in pieces, because views and 
+//  strings have int lengths. The limit is well below INT_MAX, so that
+//  a piece still fits when formatting makes it longer
+#ifndef KMSINPUT_LINE_MAX
+#define KMSINPUT_LINE_MAX ((size_t)INT_MAX / 8)
+#endif
+
+struct _KMSInput
+  {
+  int fd;
+  BOOL close_fd;    // FALSE for stdin
+  BOOL borrowed;    // TRUE if buff belongs to the caller
+  char *map;        // The mapping, or NULL if we are reading a stream
+  BOOL whole;       // TRUE if buff has the whole file, mapped or not
+  char *buff;       // Data read from the stream, or the mapping
+  size_t cap;       // Bytes allocated for buff, if reading a stream
+  size_t pos;       // Start of the next line in buff
+  size_t len;       // Bytes of data in buff
+  BOOL eof;         // TRUE when the stream has no more to read
+  off_t size;       // File size, or -1 if not known
+  KMSScanSet eol;   // CR and LF, for kmsinput_next_text_line
+  };
+
+
+/*==========================================================================
+kmsinput_read_whole
+Read a small file into a buffer of its own. If it can't all be read,
+the input ends where the reading stopped, as it would for a stream.
+*==========================================================================*/
+static void kmsinput_read_whole (KMSInput *self, size_t size)
+  {
+  self->buff = malloc (size);
+  self->cap = size;
+  while (self->len < size)
+    {
+    ssize_t n = read (self->fd, self->buff + self->len, size - self->len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    self->len += n;
+    }
+  self->eof = TRUE;
+  self->whole = TRUE;
+  }
+
+
+/*==========================================================================
+kmsinput_open_file
+Returns NULL, with errno set, if the file can't be opened
+*==========================================================================*/
+static KMSInput *kmsinput_open_file (const char *filename, BOOL map_file)
+  {
+  int fd;
+  BOOL is_stdin = (strcmp (filename, "-") == 0);
+  if (is_stdin)
+    fd = 0;
+  else
+    fd = open (filename, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  KMSInput *self = malloc (sizeof (KMSInput));
+  memset (self, 0, sizeof (KMSInput));
+  self->fd = fd;
+  self->close_fd = !is_stdin;
+  self->size = -1;
+  kmsscan_set_init (&self->eol, "\n\r", 2);
+
+  struct stat sb;
+  if (fstat (fd, &sb) == 0 && S_ISREG (sb.st_mode))
+    {
+    self->size = sb.st_size;
+    if (map_file && sb.st_size > 0 && sb.st_size < KMSINPUT_MAP_MIN)
+      kmsinput_read_whole (self, sb.st_size);
+    else if (map_file && sb.st_size > 0)
+      {
+      // The mapping is writable but private, so callers can modify
+      //  lines in place. Pages are only copied if they are modified.
+      void *map = mmap (NULL, sb.st_size, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+        {
+        madvise (map, sb.st_size, MADV_SEQUENTIAL);
+        self->map = map;
+        self->buff = map;
+        self->len = sb.st_size;
+        self->eof = TRUE;
+        self->whole = TRUE;
+        }
+      }
+    }
+
+  return self;
+  }
+
+
+/*==========================================================================
+kmsinput_open
+Returns NULL, with errno set, if the file can't be opened
+*==========================================================================*/
+KMSInput *kmsinput_open (const char *filename)
+  {
+  return kmsinput_open_file (filename, TRUE);
+  }
+
+
+/*==========================================================================
+kmsinput_open_unmapped
+Like kmsinput_open, but always read the file through a buffer. The 
+memory used then depends only on the length of the longest line. 
+*==========================================================================*/
+KMSInput *kmsinput_open_unmapped (const char *filename)
+  {
+  return kmsinput_open_file (filename, FALSE);
+  }
+
+
+/*==========================================================================
+kmsinput_open_buffer
+Read lines from len bytes at buff, which remain the caller's. Lines
+may be modified in place, as they can for a file.
+*==========================================================================*/
+KMSInput *kmsinput_open_buffer (char *buff, size_t len)
+  {
+  KMSInput *self = malloc (sizeof (KMSInput));
+  memset (self, 0, sizeof (KMSInput));
+  self->fd = -1;
+  self->borrowed = TRUE;
+  self->buff = buff;
+  self->len = len;
+  self->size = len;
+  self->eof = TRUE;
+  kmsscan_set_init (&self->eol, "\n\r", 2);
+  return self;
+  }
+
+
+/*==========================================================================
+kmsinput_data
+Returns the whole of a file that was opened by kmsinput_open, and its 
+length in len, or NULL if the input is a stream. 
+*==========================================================================*/
+char *kmsinput_data (const KMSInput *self, size_t *len)
+  {
+  *len = self->len;
+  return self->whole ? self->buff : NULL;
+  }
+
+
+/*==========================================================================
+kmsinput_close
+*==========================================================================*/
+void kmsinput_close (KMSInput *self)
+  {
+  if (!self) return;
+  if (self->map)
+    munmap (self->map, self->len);
+  else if (!self->borrowed)
+    free (self->buff);
+  if (self->close_fd)
+    close (self->fd);
+  free (self);
+  }
+
+
+/*==========================================================================
+kmsinput_size
+*==========================================================================*/
+off_t kmsinput_size (const KMSInput *self)
+  {
+  return self->size;
+  }
+
+
+/*==========================================================================
+kmsinput_prefetch
+Ask the kernel to start reading a memory-mapped file now, rather than
+when we get to each page. This returns at once; the reading goes on 
+in the background.
+*==========================================================================*/
+void kmsinput_prefetch (KMSInput *self)
+  {
+  if (self->map)
+    madvise (self->map, self->len, MADV_WILLNEED);
+  }
+
+
+/*==========================================================================
+kmsinput_fill
+Read more data from a stream into the buffer. Whatever is left of the
+current line is moved to the start of the buffer first, and the buffer
+is enlarged if the line already fills it. Returns FALSE at end of 
+input, or on error.
+*==========================================================================*/
+static BOOL kmsinput_fill (KMSInput *self)
+  {
+  if (self->eof) return FALSE;
+
+  if (self->pos > 0)
+    {
+    memmove (self->buff, self->buff + self->pos, self->len - self->pos);
+    self->len -= self->pos;
+    self->pos = 0;
+    }
+  if (self->cap - self->len < KMSINPUT_READ_SIZE)
+    {
+    self->cap = self->cap * 2 + KMSINPUT_READ_SIZE;
+    self->buff = realloc (self->buff, self->cap);
+    }
+
+  ssize_t n;
+  do
+    n = read (self->fd, self->buff + self->len, self->cap - self->len);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    {
+    self->eof = TRUE;
+    return FALSE;
+    }
+  self->len += n;
+  return TRUE;
+  }
+
+
+/*==========================================================================
+kmsinput_split_point
+Where to split a line that is longer than n bytes, if the text starts 
+at s: at n, or a little before it, so as not to split a UTF-8 
+character. 
+*==========================================================================*/
+static size_t kmsinput_split_point (const char *s, size_t n)
+  {
+  size_t i;
+  for (i = 0; i < 3 && i < n; i++)
+    if (((unsigned char)s[n - i] & 0xC0) != 0x80) return n - i;
+  return n;
+  }
+
+
+/*==========================================================================
+kmsinput_next_line
+Sets line to the next line of input, including its newline, if any.
+A line longer than KMSINPUT_LINE_MAX comes in pieces without newlines.
+Returns FALSE when there are no more lines. 
+*==========================================================================*/
+BOOL kmsinput_next_line (KMSInput *self, KMSStringView *line)
+  {
+  size_t scanned = 0;
+  for (;;)
+    {
+    char *start = self->buff + self->pos;
+    size_t avail = self->len - self->pos;
+    char *nl = NULL;
+    if (avail > scanned)
+      nl = memchr (start + scanned, '\n', avail - scanned);
+    if (nl && (size_t)(nl - start) < KMSINPUT_LINE_MAX)
+      {
+      *line = kmsstringview_create (start, nl - start + 1);
+      self->pos += nl - start + 1;
+      return TRUE;
+      }
+    if (avail > KMSINPUT_LINE_MAX)
+      {
+      size_t n = kmsinput_split_point (start, KMSINPUT_LINE_MAX);
+      *line = kmsstringview_create (start, n);
+      self->pos += n;
+      return TRUE;
+      }
+    scanned = avail;
+    if (!kmsinput_fill (self))
+      {
+      // No more input, so what's left is the last line, if there is one.
+      //  The attempt to fill the buffer may have moved it.
+      if (avail == 0) return FALSE;
+      start = self->buff + self->pos;
+      *line = kmsstringview_create (start, avail);
+      self->pos += avail;
+      return TRUE;
+      }
+    }
+  }
+
+
+
+/*==========================================================================
+kmsinput_peek_text_line
+A copy of the line that kmsinput_next_text_line would give next, as a
+string that the caller must free, but without moving on to the next 
+line, or changing the input. Like strndup(), the copy ends at a zero 
+byte, if there is one. Returns NULL if there are no more lines.
+*==========================================================================*/
+char *kmsinput_peek_text_line (KMSInput *self)
+  {
+  size_t scanned = 0;
+  char *nl = NULL;
+  for (;;)
+    {
+    // Filling the buffer can move the line, but it still starts at pos
+    size_t avail = self->len - self->pos;
+    if (avail > scanned)
+      nl = memchr (self->buff + self->pos + scanned, '\n', 
+        avail - scanned);
+    if (nl) break;
+    scanned = avail;
+    if (!kmsinput_fill (self)) break;
+    }
+  size_t avail = self->len - self->pos;
+  if (avail == 0) return NULL;
+
+  char *start = self->buff + self->pos;
+  char *line = strndup (start, nl ? (size_t)(nl - start + 1) : avail);
+  char *p, *q;
+  for (p = q = line; *p; p++)
+    if (*p != '\r') *q++ = *p;
+  *q = 0;
+  return line;
+  }
+
+
+/*==========================================================================
+kmsinput_next_text_line
+Sets line to the next line of input, with any carriage returns removed.
+The scan for the end of the line stops at CR as well as LF, and the 
+text between CRs is moved down over them as we go, so the line is only
+looked at once. A line longer than KMSINPUT_LINE_MAX comes in pieces 
+without newlines. Returns FALSE when there are no more lines. 
+*==========================================================================*/
+BOOL kmsinput_next_text_line (KMSInput *self, KMSInputLine *line)
+  {
+  size_t r = 0;    // Bytes of the line read so far
+  size_t w = 0;    // Bytes of the line kept so far
+  for (;;)
+    {
+    // start can change when the buffer is filled, but the offsets can't
+    char *start = self->buff + self->pos;
+    size_t avail = self->len - self->pos;
+    while (r < avail)
+      {
+      size_t chunk = avail - r;
+      BOOL split = (chunk > KMSINPUT_LINE_MAX - w);
+      if (split)
+        chunk = kmsinput_split_point (start + r, KMSINPUT_LINE_MAX - w);
+      size_t run = kmsscan_find (&self->eol, start + r, chunk);
+      if (w != r) memmove (start + w, start + r, run);
+      w += run;
+      r += run;
+      if (run == chunk && split)
+        {
+        line->text = kmsstringview_create (start, w);
+        line->len = w;
+        line->blank = (w == 0);
+        self->pos += r;
+        return TRUE;
+        }
+      if (run == chunk) continue;
+      if (start[r++] == '\r') continue;
+      start[w] = '\n';
+      line->text = kmsstringview_create (start, w + 1);
+      line->len = w;
+      line->blank = (w == 0);
+      self->pos += r;
+      return TRUE;
+      }
+    if (!kmsinput_fill (self))
+      {
+      // No more input, so what's left is the last line, if there is one
+      if (avail == 0) return FALSE;
+      line->text = kmsstringview_create (self->buff + self->pos, w);
+      line->len = w;
+      line->blank = (w == 0);
+      self->pos += avail;
+      return TRUE;
+      }
+    }
+  }
@@ -0,0 +1,69 @@
+/*==========================================================================
+txt2epub
+kmsinput.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include <sys/types.h>
+#include "kmsconstants.h"
+#include "kmsstring.h"
+
+// A KMSInput reads a file one line at a time, handing out each line as a
+//  view into its own buffer, rather than as a copy. Regular files are 
+//  memory-mapped, so there is no buffer other than the page cache,
+//  except for small ones, which are cheaper to read in one go. Pipes,
+//  terminals, and stdin (filename "-") are read through a buffer that
+//  grows to hold the longest line, as are files opened with
+//  kmsinput_open_unmapped.
+//
+// Each line includes its terminating newline, if it has one, like 
+//  getline(). A line view is valid until the next call to 
+//  kmsinput_next_line. The mapping is private, so the caller may modify 
+//  the bytes of a line in place without changing the file. A line too 
+//  long for an int length is handed out in pieces, each without a 
+//  newline, so a line's length always fits in KMSInputLine.len.
+
+//
+// kmsinput_next_text_line is for text that might have come from DOS or
+//  Windows: it removes carriage returns from the line as it looks for
+//  the newline, and reports the length of the line without the newline,
+//  so the caller doesn't have to scan the line again.
+//  kmsinput_peek_text_line gives a copy of the next such line without
+//  reading past it, so that the first line of a file can be used as 
+//  its title, before the whole file is formatted.
+//
+// kmsinput_data gives the whole of a file opened by kmsinput_open, so it can
+//  be divided up, and kmsinput_open_buffer reads lines from any part 
+//  of it, or from any other buffer that the caller owns.
+
+struct _KMSInput;
+typedef struct _KMSInput KMSInput;
+
+typedef struct _KMSInputLine
+  {
+  KMSStringView text; // The line, with its newline, if it has one
+  int len;            // The length of text, not counting the newline
+  BOOL blank;         // TRUE if there is nothing but the newline
+  } KMSInputLine;
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+KMSInput     *kmsinput_open (const char *filename);
+void         kmsinput_close (KMSInput *self);
+KMSInput     *kmsinput_open_unmapped (const char *filename);
+KMSInput     *kmsinput_open_buffer (char *buff, size_t len);
+char         *kmsinput_data (const KMSInput *self, size_t *len);
+BOOL         kmsinput_next_line (KMSInput *self, KMSStringView *line);
+BOOL         kmsinput_next_text_line (KMSInput *self, KMSInputLine *line);
+char         *kmsinput_peek_text_line (KMSInput *self);
+off_t        kmsinput_size (const KMSInput *self);
+void         kmsinput_prefetch (KMSInput *self);
+
+#ifdef __cplusplus 
+}
+#endif
+
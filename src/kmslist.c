@@ -1,7 +1,7 @@
 /*==========================================================================
 txt2epub
 list.c
-A simple linked list
+A simple list, kept in an array that grows as needed
 Copyright (c)2017 Kevin Boone, GPLv3.0
 *==========================================================================*/
 
@@ -12,17 +12,23 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 #include <pthread.h>
 #include "kmslist.h"
 
-typedef struct _KMSListItem
-  {
-  struct _KMSListItem *next;
-  void *data;
-  } KMSListItem;
+// Items are kept in order in an array, which doubles in size when it is
+//  full, so appending is quick on average, and any item can be got
+//  straight away by its index.
+//
+// Every function takes the list's mutex, so that a list can be shared
+//  between threads. The _unlocked versions do not: they are for lists
+//  that only one thread is using, or that nothing is changing.
+
+#define KMSLIST_MIN_CAP 16
 
 struct _KMSList
   {
   pthread_mutex_t mutex;
-  KMSListItemFreeFn free_fn; 
-  KMSListItem *head;
+  KMSListItemFreeFn free_fn;
+  void **items;
+  int len;
+  int cap;
   };
 
 /*==========================================================================
@@ -38,7 +44,7 @@ KMSList *kmslist_create (KMSListItemFreeFn free_fn)
   }
 
 /*==========================================================================
-kmslist_create_strings 
+kmslist_create_strings
 *==========================================================================*/
 KMSList *kmslist_create_strings (void)
   {
@@ -53,15 +59,11 @@ void kmslist_destroy (KMSList *self)
   if (!self) return;
 
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *l = self->head;
-  while (l)
-    {
-    if (self->free_fn)
-      self->free_fn (l->data);
-    KMSListItem *temp = l;
-    l = l->next;
-    free (temp);
-    }
+  int i;
+  if (self->free_fn)
+    for (i = 0; i < self->len; i++)
+      self->free_fn (self->items[i]);
+  free (self->items);
 
   pthread_mutex_unlock (&self->mutex);
   pthread_mutex_destroy (&self->mutex);
@@ -69,28 +71,32 @@ void kmslist_destroy (KMSList *self)
   }
 
 
+/*==========================================================================
+list_grow
+Make room for at least one more item
+*==========================================================================*/
+static void kmslist_grow (KMSList *self)
+  {
+  if (self->len < self->cap) return;
+  self->cap = self->cap ? self->cap * 2 : KMSLIST_MIN_CAP;
+  self->items = realloc (self->items, self->cap * sizeof (void *));
+  }
+
+
 /*==========================================================================
 list_prepend
 Note that the caller must not modify or free the item added to the list. It
 will remain on the list until free'd by the list itself, by calling
-the supplied free function
+the supplied free function. Everything else has to move up, so this is
+slower than kmslist_append.
 *==========================================================================*/
 void kmslist_prepend (KMSList *self, void *item)
   {
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *i = malloc (sizeof (KMSListItem));
-  i->data = item;
-  i->next = NULL;
-
-  if (self->head)
-    {
-    i->next = self->head;
-    self->head = i;
-    }
-  else
-    {
-    self->head = i;
-    }
+  kmslist_grow (self);
+  memmove (self->items + 1, self->items, self->len * sizeof (void *));
+  self->items[0] = item;
+  self->len++;
   pthread_mutex_unlock (&self->mutex);
   }
 
@@ -104,25 +110,21 @@ the supplied free function
 void kmslist_append (KMSList *self, void *item)
   {
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *i = malloc (sizeof (KMSListItem));
-  i->data = item;
-  i->next = NULL;
-
-  if (self->head)
-    {
-    KMSListItem *l = self->head;
-    while (l->next)
-      l = l->next;
-    l->next = i;
-    }
-  else
-    {
-    self->head = i;
-    }
+  kmslist_append_unlocked (self, item);
   pthread_mutex_unlock (&self->mutex);
   }
 
 
+/*==========================================================================
+list_append_unlocked
+*==========================================================================*/
+void kmslist_append_unlocked (KMSList *self, void *item)
+  {
+  kmslist_grow (self);
+  self->items[self->len++] = item;
+  }
+
+
 /*==========================================================================
 list_length
 *==========================================================================*/
@@ -131,36 +133,42 @@ int kmslist_length (KMSList *self)
   if (!self) return 0;
 
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *l = self->head;
-  int i = 0;
-  while (l != NULL)
-    {
-    l = l->next;
-    i++;
-    }
-
+  int i = self->len;
   pthread_mutex_unlock (&self->mutex);
   return i;
   }
 
+/*==========================================================================
+list_length_unlocked
+*==========================================================================*/
+int kmslist_length_unlocked (const KMSList *self)
+  {
+  return self ? self->len : 0;
+  }
+
 /*==========================================================================
 list_get
+Returns NULL if there is no item at index
 *==========================================================================*/
 void *kmslist_get (KMSList *self, int index)
   {
   if (!self) return NULL;
 
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *l = self->head;
-  int i = 0;
-  while (l != NULL && i != index)
-    {
-    l = l->next;
-    i++;
-    }
+  void *data = kmslist_get_unlocked (self, index);
   pthread_mutex_unlock (&self->mutex);
 
-  return l->data;
+  return data;
+  }
+
+
+/*==========================================================================
+list_get_unlocked
+*==========================================================================*/
+void *kmslist_get_unlocked (const KMSList *self, int index)
+  {
+  if (!self || index < 0 || index >= self->len) return NULL;
+  return self->items[index];
   }
 
 
@@ -169,12 +177,14 @@ list_dump
 *==========================================================================*/
 void kmslist_dump (KMSList *self)
   {
-  int i, l = kmslist_length (self);
-  for (i = 0; i < l; i++)
+  pthread_mutex_lock (&self->mutex);
+  int i;
+  for (i = 0; i < self->len; i++)
     {
-    const char *s = kmslist_get (self, i);
+    const char *s = self->items[i];
     printf ("%s\n", s);
     }
+  pthread_mutex_unlock (&self->mutex);
   }
 
 
@@ -185,15 +195,14 @@ BOOL kmslist_contains (KMSList *self, const void *item, KMSListCompareFn fn)
   {
   if (!self) return FALSE;
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *l = self->head;
   BOOL found = FALSE;
-  while (l != NULL && !found)
+  int i;
+  for (i = 0; i < self->len && !found; i++)
     {
-    if (fn (l->data, item) == 0) found = TRUE; 
-    l = l->next;
+    if (fn (self->items[i], item) == 0) found = TRUE;
     }
   pthread_mutex_unlock (&self->mutex);
-  return found; 
+  return found;
   }
 
 
@@ -218,31 +227,18 @@ void kmslist_remove (KMSList *self, const void *item, KMSListCompareFn fn)
   {
   if (!self) return;
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *l = self->head;
-  KMSListItem *last_good = NULL;
-  while (l != NULL)
+  // Items that stay are moved down over the ones that go, in one pass
+  int i, kept = 0;
+  for (i = 0; i < self->len; i++)
     {
-    if (fn (l->data, item) == 0)
-      {
-      if (l == self->head)
-        {
-        self->head = l->next; // l-> next might be null
-        }
-      else
-        {
-        if (last_good) last_good->next = l->next;
-        }
-      self->free_fn (l->data);  
-      KMSListItem *temp = l->next;
-      free (l);
-      l = temp;
-      } 
-    else
+    if (fn (self->items[i], item) == 0)
       {
-      last_good = l;
-      l = l->next;
+      if (self->free_fn) self->free_fn (self->items[i]);
       }
+    else
+      self->items[kept++] = self->items[i];
     }
+  self->len = kept;
   pthread_mutex_unlock (&self->mutex);
   }
 
@@ -260,17 +256,16 @@ list_clone
 *==========================================================================*/
 KMSList *kmslist_clone (KMSList *self, KMSListCopyFn copyFn)
   {
-  KMSListItemFreeFn free_fn = self->free_fn; 
+  KMSListItemFreeFn free_fn = self->free_fn;
   KMSList *new = kmslist_create (free_fn);
 
   pthread_mutex_lock (&self->mutex);
-  KMSListItem *l = self->head;
-  while (l != NULL)
-    {
-    void *data = copyFn (l->data);
-    kmslist_append (new, data);
-    l = l->next;
-    }
+  new->cap = self->len > KMSLIST_MIN_CAP ? self->len : KMSLIST_MIN_CAP;
+  new->items = malloc (new->cap * sizeof (void *));
+  int i;
+  for (i = 0; i < self->len; i++)
+    new->items[i] = copyFn (self->items[i]);
+  new->len = self->len;
   pthread_mutex_unlock (&self->mutex);
 
   return new;
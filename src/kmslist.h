@@ -30,3 +30,9 @@ void kmslist_remove_string (KMSList *self, const char *item);
 KMSList *kmslist_clone (KMSList *self, KMSListCopyFn copyFn);
 KMSList *kmslist_create_strings (void);
 
+// Without taking the list's mutex: for a list that only one thread uses,
+//  or that no thread is changing
+void kmslist_append_unlocked (KMSList *self, void *item);
+void *kmslist_get_unlocked (const KMSList *self, int index);
+int kmslist_length_unlocked (const KMSList *self);
+
@@ -12,20 +12,27 @@ Copyright (c)2017 Kevin Boone, GPL v3.0
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "kmsconstants.h"
 #include "kmslogging.h"
 
 
+// The settings are normally made once, at start-up, but may be changed
+//  while other threads are logging, so they are read and written 
+//  atomically. log_mutex keeps messages from different threads from
+//  being mixed up on the console.
 static int log_level = DEBUG;
 static BOOL log_syslog = TRUE;
 static BOOL log_console = TRUE;
+static BOOL log_stderr = FALSE;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*==========================================================================
 logging_set_level
 *==========================================================================*/
 void kmslogging_set_level (const int level)
   {
-  log_level = level;
+  __atomic_store_n (&log_level, level, __ATOMIC_RELAXED);
   }
 
 /*==========================================================================
@@ -33,7 +40,7 @@ logging_set_log_syslog
 *==========================================================================*/
 void kmslogging_set_log_syslog (const BOOL f)
   {
-  log_syslog = f;
+  __atomic_store_n (&log_syslog, f, __ATOMIC_RELAXED);
   }
 
 /*==========================================================================
@@ -41,7 +48,17 @@ logging_set_log_console
 *==========================================================================*/
 void kmslogging_set_log_console (const BOOL f)
   {
-  log_console = f;
+  __atomic_store_n (&log_console, f, __ATOMIC_RELAXED);
+  }
+
+/*==========================================================================
+logging_set_log_stderr
+Send console messages to stderr, rather than stdout -- when stdout is
+being used for output, for example
+*==========================================================================*/
+void kmslogging_set_log_stderr (const BOOL f)
+  {
+  __atomic_store_n (&log_stderr, f, __ATOMIC_RELAXED);
   }
 
 /*==========================================================================
@@ -61,12 +78,15 @@ log_vprintf
 *==========================================================================*/
 void kmslog_vprintf (const int level, const char *fmt, va_list ap)
   {
-  if (log_console)
+  if (__atomic_load_n (&log_console, __ATOMIC_RELAXED))
     {
-    if (level > log_level) return;
+    if (level > __atomic_load_n (&log_level, __ATOMIC_RELAXED)) return;
     char *str = NULL;
     vasprintf (&str, fmt, ap);
-    printf ("%s %s\n", level_to_text (level), str);
+    pthread_mutex_lock (&log_mutex);
+    fprintf (__atomic_load_n (&log_stderr, __ATOMIC_RELAXED) 
+      ? stderr : stdout, "%s %s\n", level_to_text (level), str);
+    pthread_mutex_unlock (&log_mutex);
     free (str);
     }
   }
@@ -81,7 +101,7 @@ void kmslog_error (const char *fmt,...)
   va_start (ap, fmt);
   kmslog_vprintf (ERROR,  fmt, ap);
   va_end (ap);
-  if (log_syslog)
+  if (__atomic_load_n (&log_syslog, __ATOMIC_RELAXED))
     {
     va_start (ap, fmt);
     vsyslog (LOG_ERR, fmt, ap);
@@ -99,7 +119,7 @@ void kmslog_warning (const char *fmt,...)
   va_start (ap, fmt);
   kmslog_vprintf (WARNING,  fmt, ap);
   va_end (ap);
-  if (log_syslog)
+  if (__atomic_load_n (&log_syslog, __ATOMIC_RELAXED))
     {
     va_start (ap, fmt);
     vsyslog (LOG_WARNING, fmt, ap);
@@ -117,7 +137,7 @@ void kmslog_info (const char *fmt,...)
   va_start (ap, fmt);
   kmslog_vprintf (INFO,  fmt, ap);
   va_end (ap);
-  if (log_syslog)
+  if (__atomic_load_n (&log_syslog, __ATOMIC_RELAXED))
     {
     va_start (ap, fmt);
     vsyslog (LOG_INFO, fmt, ap);
@@ -21,4 +21,5 @@ void kmslogging_set_level (const int level);
 
 void kmslogging_set_log_syslog (const BOOL f);
 void kmslogging_set_log_console (const BOOL f);
+void kmslogging_set_log_stderr (const BOOL f);
 
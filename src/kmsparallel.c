@@ -0,0 +1,80 @@
+/*==========================================================================
+txt2epub
+kmsparallel.c
+A simple parallel 'for' loop on a pool of threads
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "kmslogging.h"
+#include "kmsparallel.h"
+
+typedef struct _KMSParallelJob
+  {
+  int n;
+  int next;         // The next index to hand out
+  KMSParallelFn fn;
+  void *arg;
+  } KMSParallelJob;
+
+
+/*==========================================================================
+kmsparallel_worker
+*==========================================================================*/
+static void *kmsparallel_worker (void *arg)
+  {
+  KMSParallelJob *job = arg;
+  int i;
+  while ((i = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED)) 
+        < job->n)
+    job->fn (i, job->arg);
+  return NULL;
+  }
+
+
+/*==========================================================================
+kmsparallel_for
+If a thread can't be started, we just carry on with fewer. 
+*==========================================================================*/
+void kmsparallel_for (int jobs, int n, KMSParallelFn fn, void *arg)
+  {
+  KMSParallelJob job = { n, 0, fn, arg };
+  if (jobs > n) jobs = n;
+  if (jobs <= 1) 
+    {
+    kmsparallel_worker (&job);
+    return;
+    }
+
+  pthread_t *threads = malloc ((jobs - 1) * sizeof (pthread_t));
+  int i, started = 0;
+  for (i = 0; i < jobs - 1; i++)
+    {
+    if (pthread_create (&threads[started], NULL, kmsparallel_worker, 
+         &job) == 0)
+      started++;
+    else
+      kmslog_warning ("Can't start worker thread");
+    }
+  kmslog_debug ("Running %d jobs on %d threads", n, started + 1);
+
+  kmsparallel_worker (&job);
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+  free (threads);
+  }
+
+
+/*==========================================================================
+kmsparallel_cpus
+The number of processors that are online, or 1 if we can't tell 
+*==========================================================================*/
+int kmsparallel_cpus (void)
+  {
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+  }
+
@@ -0,0 +1,30 @@
+/*==========================================================================
+txt2epub
+kmsparallel.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include "kmsconstants.h"
+
+// kmsparallel_for calls fn once for each index from 0 to n - 1, on up 
+//  to 'jobs' threads, including the calling thread. Indexes are handed
+//  out in order, one at a time, as threads become free, so long and 
+//  short jobs balance out. It returns when every call has finished. 
+//  With jobs <= 1, everything happens on the calling thread, in order.
+
+typedef void (*KMSParallelFn) (int index, void *arg);
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+void         kmsparallel_for (int jobs, int n, KMSParallelFn fn, 
+                void *arg);
+int          kmsparallel_cpus (void);
+
+#ifdef __cplusplus 
+}
+#endif
+
@@ -0,0 +1,176 @@
+/*==========================================================================
+txt2epub
+kmsqueue.c
+A bounded lock-free queue, with blocking push and pop
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <semaphore.h>
+#include "kmslogging.h"
+#include "kmsqueue.h"
+
+// Each slot has a sequence number that says whose turn it is. A slot 
+//  at position pos is free for the producer that claims pos when its
+//  sequence is pos, and ready for the consumer that claims pos when 
+//  it is pos + 1. This is D. Vyukov's bounded MPMC queue. 
+typedef struct _KMSQueueSlot
+  {
+  size_t seq;
+  void *item;
+  } KMSQueueSlot;
+
+struct _KMSQueue
+  {
+  char *name;
+  KMSQueueSlot *slots;
+  size_t mask;              // Capacity (a power of two) - 1
+  int capacity;             // As requested
+  // Keep the producers' and consumers' positions on separate cache
+  //  lines, so they don't slow each other down
+  size_t push_pos __attribute__((aligned(64)));
+  size_t pop_pos __attribute__((aligned(64)));
+  sem_t free_slots;
+  sem_t items;
+  // Statistics
+  long pushes;
+  long full_waits;          // Pushes that had to wait for a free slot
+  long empty_waits;         // Pops that had to wait for an item
+  long occupancy;           // Total of the length, seen by each pop
+  };
+
+
+/*==========================================================================
+kmsqueue_create
+The name is only used in log messages. 
+*==========================================================================*/
+KMSQueue *kmsqueue_create (const char *name, int capacity)
+  {
+  KMSQueue *self = aligned_alloc (64, 
+    (sizeof (KMSQueue) + 63) / 64 * 64);
+  memset (self, 0, sizeof (KMSQueue));
+  size_t size = 1;
+  if (capacity < 1) capacity = 1;
+  while (size < (size_t)capacity) size <<= 1;
+  self->name = strdup (name);
+  self->capacity = capacity;
+  self->mask = size - 1;
+  self->slots = malloc (size * sizeof (KMSQueueSlot));
+  size_t i;
+  for (i = 0; i < size; i++)
+    self->slots[i].seq = i;
+  // The ring may be larger than the capacity, but the semaphore makes
+  //  sure no more than capacity slots are ever in use
+  sem_init (&self->free_slots, 0, capacity);
+  sem_init (&self->items, 0, 0);
+  return self;
+  }
+
+
+/*==========================================================================
+kmsqueue_destroy
+*==========================================================================*/
+void kmsqueue_destroy (KMSQueue *self)
+  {
+  if (!self) return;
+  sem_destroy (&self->free_slots);
+  sem_destroy (&self->items);
+  free (self->slots);
+  free (self->name);
+  free (self);
+  }
+
+
+/*==========================================================================
+kmsqueue_push
+Add an item to the queue, waiting for room if it is full
+*==========================================================================*/
+void kmsqueue_push (KMSQueue *self, void *item)
+  {
+  if (sem_trywait (&self->free_slots) != 0)
+    {
+    __atomic_add_fetch (&self->full_waits, 1, __ATOMIC_RELAXED);
+    while (sem_wait (&self->free_slots) != 0)
+      ; // EINTR
+    }
+
+  // There is a free slot, but the semaphore doesn't say which one. It 
+  //  might not be the one at our position, if a consumer of an earlier 
+  //  item hasn't quite finished with it, in which case we wait a little 
+  size_t pos = __atomic_fetch_add (&self->push_pos, 1, __ATOMIC_RELAXED);
+  KMSQueueSlot *slot = &self->slots[pos & self->mask];
+  while (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != pos)
+    sched_yield ();
+  slot->item = item;
+  __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch (&self->pushes, 1, __ATOMIC_RELAXED);
+
+  sem_post (&self->items);
+  }
+
+
+/*==========================================================================
+kmsqueue_pop
+Remove the item at the head of the queue, waiting for one if it is empty
+*==========================================================================*/
+void *kmsqueue_pop (KMSQueue *self)
+  {
+  if (sem_trywait (&self->items) != 0)
+    {
+    __atomic_add_fetch (&self->empty_waits, 1, __ATOMIC_RELAXED);
+    while (sem_wait (&self->items) != 0)
+      ; // EINTR
+    }
+  __atomic_add_fetch (&self->occupancy, kmsqueue_length (self) + 1, 
+    __ATOMIC_RELAXED);
+
+  size_t pos = __atomic_fetch_add (&self->pop_pos, 1, __ATOMIC_RELAXED);
+  KMSQueueSlot *slot = &self->slots[pos & self->mask];
+  while (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+    sched_yield ();
+  void *item = slot->item;
+  __atomic_store_n (&slot->seq, pos + self->mask + 1, __ATOMIC_RELEASE);
+
+  sem_post (&self->free_slots);
+  return item;
+  }
+
+
+/*==========================================================================
+kmsqueue_length
+The number of items waiting to be popped. This is only a snapshot, of
+course, if other threads are using the queue.
+*==========================================================================*/
+int kmsqueue_length (const KMSQueue *self)
+  {
+  int n = 0;
+  sem_getvalue ((sem_t *)&self->items, &n);
+  return n > 0 ? n : 0;
+  }
+
+
+/*==========================================================================
+kmsqueue_capacity
+*==========================================================================*/
+int kmsqueue_capacity (const KMSQueue *self)
+  {
+  return self->capacity;
+  }
+
+
+/*==========================================================================
+kmsqueue_log_stats
+Log, at debug level, how busy the queue has been 
+*==========================================================================*/
+void kmsqueue_log_stats (const KMSQueue *self)
+  {
+  kmslog_debug ("Queue %s: %ld items, mean occupancy %.1f of %d, "
+    "%ld pushes waited (full), %ld pops waited (empty)", self->name, 
+    self->pushes, self->pushes ? (double)self->occupancy / self->pushes : 0.0,
+    self->capacity, self->full_waits, self->empty_waits);
+  }
+
@@ -0,0 +1,43 @@
+/*==========================================================================
+txt2epub
+kmsqueue.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include "kmsconstants.h"
+
+// A KMSQueue is a bounded, first-in, first-out queue of pointers, which
+//  any number of threads can push to and pop from. The queue itself
+//  is lock-free: items are claimed and released with atomic operations
+//  on a ring of slots. A thread that pushes to a full queue, or pops
+//  from an empty one, sleeps on a semaphore until it can go on, so a
+//  slow consumer holds back its producers, and the number of items in 
+//  flight is never more than the queue's capacity. 
+//
+// The queue also keeps figures that show whether it is usually full,
+//  which suggests that its consumers are the bottleneck, or usually
+//  empty, which suggests its producers are. 
+//
+// NULL can be queued like any other pointer.
+
+struct _KMSQueue;
+typedef struct _KMSQueue KMSQueue;
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+KMSQueue     *kmsqueue_create (const char *name, int capacity);
+void         kmsqueue_destroy (KMSQueue *self);
+void         kmsqueue_push (KMSQueue *self, void *item);
+void         *kmsqueue_pop (KMSQueue *self);
+int          kmsqueue_length (const KMSQueue *self);
+int          kmsqueue_capacity (const KMSQueue *self);
+void         kmsqueue_log_stats (const KMSQueue *self);
+
+#ifdef __cplusplus 
+}
+#endif
+
@@ -0,0 +1,279 @@
+/*==========================================================================
+txt2epub
+kmsscan.c
+Vectorized search for bytes in a small set
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kmsscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KMSSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef int (*KMSScanFindFn) (const KMSScanSet *set, const char *s, 
+   int len);
+typedef unsigned (*KMSScanPresentFn) (const KMSScanSet *set, 
+   const char *s, int len);
+
+static int kmsscan_find_scalar (const KMSScanSet *set, const char *s, 
+   int len);
+static unsigned kmsscan_present_scalar (const KMSScanSet *set, 
+   const char *s, int len);
+
+static KMSScanFindFn find_fn = kmsscan_find_scalar;
+static KMSScanPresentFn present_fn = kmsscan_present_scalar;
+static const char *impl_name = "scalar";
+
+
+/*==========================================================================
+kmsscan_set_init
+Set up a set of up to KMSSCAN_MAX bytes
+*==========================================================================*/
+void kmsscan_set_init (KMSScanSet *set, const char *bytes, int n)
+  {
+  int i;
+  memset (set, 0, sizeof (KMSScanSet));
+  if (n > KMSSCAN_MAX) n = KMSSCAN_MAX;
+  set->n = n;
+  for (i = 0; i < n; i++)
+    {
+    set->bytes[i] = bytes[i];
+    set->table[(unsigned char)bytes[i]] = 1;
+    }
+  // Fill the unused places with copies of the first byte, so the 
+  //  vector code can always compare with KMSSCAN_MAX bytes, and the
+  //  compiler can keep them all in registers 
+  for (; i < KMSSCAN_MAX; i++)
+    set->bytes[i] = set->bytes[0];
+  }
+
+
+/*==========================================================================
+kmsscan_find_scalar
+*==========================================================================*/
+static int kmsscan_find_scalar (const KMSScanSet *set, const char *s, 
+    int len)
+  {
+  const unsigned char *p = (const unsigned char *)s;
+  int i;
+  for (i = 0; i < len; i++)
+    if (set->table[p[i]]) return i;
+  return len;
+  }
+
+
+/*==========================================================================
+kmsscan_present_scalar
+*==========================================================================*/
+static unsigned kmsscan_present_scalar (const KMSScanSet *set, 
+    const char *s, int len)
+  {
+  unsigned ret = 0;
+  int k;
+  for (k = 0; k < set->n; k++)
+    if (memchr (s, set->bytes[k], len)) ret |= 1u << k;
+  return ret;
+  }
+
+
+#ifdef KMSSCAN_X86
+
+/*==========================================================================
+kmsscan_find_sse2
+Compare 16 bytes at a time against each byte in the set. The tail, 
+shorter than 16 bytes, is done with the table.
+*==========================================================================*/
+__attribute__((target("sse2")))
+static int kmsscan_find_sse2 (const KMSScanSet *set, const char *s, 
+    int len)
+  {
+  __m128i b[KMSSCAN_MAX];
+  int i, k;
+  for (k = 0; k < KMSSCAN_MAX; k++)
+    b[k] = _mm_set1_epi8 ((char)set->bytes[k]);
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)(s + i));
+    __m128i hit = _mm_setzero_si128 ();
+    for (k = 0; k < KMSSCAN_MAX; k++)
+      hit = _mm_or_si128 (hit, _mm_cmpeq_epi8 (v, b[k]));
+    int mask = _mm_movemask_epi8 (hit);
+    if (mask) return i + __builtin_ctz (mask);
+    }
+  return i + kmsscan_find_scalar (set, s + i, len - i);
+  }
+
+
+/*==========================================================================
+kmsscan_find_avx2
+*==========================================================================*/
+__attribute__((target("avx2")))
+static int kmsscan_find_avx2 (const KMSScanSet *set, const char *s, 
+    int len)
+  {
+  __m256i b[KMSSCAN_MAX];
+  int i, k;
+  for (k = 0; k < KMSSCAN_MAX; k++)
+    b[k] = _mm256_set1_epi8 ((char)set->bytes[k]);
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+    __m256i hit = _mm256_setzero_si256 ();
+    for (k = 0; k < KMSSCAN_MAX; k++)
+      hit = _mm256_or_si256 (hit, _mm256_cmpeq_epi8 (v, b[k]));
+    unsigned mask = (unsigned)_mm256_movemask_epi8 (hit);
+    if (mask) return i + __builtin_ctz (mask);
+    }
+  // Don't hand the tail to kmsscan_find_sse2: mixing its instructions
+  //  with the AVX ones is slow on some processors
+  return i + kmsscan_find_scalar (set, s + i, len - i);
+  }
+
+
+/*==========================================================================
+kmsscan_present_sse2
+Keep a running OR of the comparisons with each byte of the set, so 
+the whole input is read once, however many bytes there are in the set.
+*==========================================================================*/
+__attribute__((target("sse2")))
+static unsigned kmsscan_present_sse2 (const KMSScanSet *set, 
+    const char *s, int len)
+  {
+  __m128i b[KMSSCAN_MAX], acc[KMSSCAN_MAX];
+  int i, k, n = set->n;
+  for (k = 0; k < n; k++)
+    {
+    b[k] = _mm_set1_epi8 ((char)set->bytes[k]);
+    acc[k] = _mm_setzero_si128 ();
+    }
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)(s + i));
+    for (k = 0; k < n; k++)
+      acc[k] = _mm_or_si128 (acc[k], _mm_cmpeq_epi8 (v, b[k]));
+    }
+
+  unsigned ret = kmsscan_present_scalar (set, s + i, len - i);
+  for (k = 0; k < n; k++)
+    if (_mm_movemask_epi8 (acc[k])) ret |= 1u << k;
+  return ret;
+  }
+
+
+/*==========================================================================
+kmsscan_present_avx2
+*==========================================================================*/
+__attribute__((target("avx2")))
+static unsigned kmsscan_present_avx2 (const KMSScanSet *set, 
+    const char *s, int len)
+  {
+  __m256i b[KMSSCAN_MAX], acc[KMSSCAN_MAX];
+  int i, k, n = set->n;
+  for (k = 0; k < n; k++)
+    {
+    b[k] = _mm256_set1_epi8 ((char)set->bytes[k]);
+    acc[k] = _mm256_setzero_si256 ();
+    }
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+    for (k = 0; k < n; k++)
+      acc[k] = _mm256_or_si256 (acc[k], _mm256_cmpeq_epi8 (v, b[k]));
+    }
+
+  unsigned ret = kmsscan_present_scalar (set, s + i, len - i);
+  for (k = 0; k < n; k++)
+    if (_mm256_movemask_epi8 (acc[k])) ret |= 1u << k;
+  return ret;
+  }
+
+#endif
+
+
+/*==========================================================================
+kmsscan_use
+Select an implementation by name: "scalar", "sse2", or "avx2". Returns
+FALSE, and changes nothing, if the processor doesn't support it. This
+is mostly for testing and benchmarking -- kmsscan_init picks the best
+one available. 
+*==========================================================================*/
+BOOL kmsscan_use (const char *impl)
+  {
+  if (strcmp (impl, "scalar") == 0)
+    {
+    find_fn = kmsscan_find_scalar;
+    present_fn = kmsscan_present_scalar;
+    }
+#ifdef KMSSCAN_X86
+  else if (strcmp (impl, "sse2") == 0 && __builtin_cpu_supports ("sse2"))
+    {
+    find_fn = kmsscan_find_sse2;
+    present_fn = kmsscan_present_sse2;
+    }
+  else if (strcmp (impl, "avx2") == 0 && __builtin_cpu_supports ("avx2"))
+    {
+    find_fn = kmsscan_find_avx2;
+    present_fn = kmsscan_present_avx2;
+    }
+#endif
+  else
+    return FALSE;
+  impl_name = impl;
+  return TRUE;
+  }
+
+
+/*==========================================================================
+kmsscan_init
+Choose the fastest implementation the processor supports. Call this
+before starting any threads.
+*==========================================================================*/
+void kmsscan_init (void)
+  {
+#ifdef KMSSCAN_X86
+  __builtin_cpu_init ();
+#endif
+  if (!kmsscan_use ("avx2"))
+    if (!kmsscan_use ("sse2"))
+      kmsscan_use ("scalar");
+  }
+
+
+/*==========================================================================
+kmsscan_impl
+*==========================================================================*/
+const char *kmsscan_impl (void)
+  {
+  return impl_name;
+  }
+
+
+/*==========================================================================
+kmsscan_find
+Returns the offset of the first byte of s that is in set, or len if
+there isn't one 
+*==========================================================================*/
+int kmsscan_find (const KMSScanSet *set, const char *s, int len)
+  {
+  return find_fn (set, s, len);
+  }
+
+
+/*==========================================================================
+kmsscan_present
+Returns a mask with bit k set if set->bytes[k] occurs anywhere in s
+*==========================================================================*/
+unsigned kmsscan_present (const KMSScanSet *set, const char *s, int len)
+  {
+  return present_fn (set, s, len);
+  }
+
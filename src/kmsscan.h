@@ -0,0 +1,40 @@
+/*==========================================================================
+txt2epub
+kmsscan.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include "kmsconstants.h"
+
+// Functions for finding bytes that belong to a small set, many bytes at
+//  a time. On x86 processors these use AVX2 or SSE2 instructions, if 
+//  available; otherwise they look up each byte in a table. The choice
+//  is made when kmsscan_init is called.
+
+#define KMSSCAN_MAX 8
+
+typedef struct _KMSScanSet
+  {
+  int n;
+  unsigned char bytes[KMSSCAN_MAX];
+  unsigned char table[256];   // Non-zero for bytes in the set
+  } KMSScanSet;
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+void         kmsscan_init (void);
+BOOL         kmsscan_use (const char *impl);
+const char   *kmsscan_impl (void);
+void         kmsscan_set_init (KMSScanSet *set, const char *bytes, int n);
+int          kmsscan_find (const KMSScanSet *set, const char *s, int len);
+unsigned     kmsscan_present (const KMSScanSet *set, const char *s, 
+                int len);
+
+#ifdef __cplusplus 
+}
+#endif
+
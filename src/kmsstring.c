@@ -23,8 +23,33 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 struct _KMSString
   {
   char *str;
+  size_t len;       // Bytes in str, not counting the terminating zero
+  size_t cap;       // Bytes allocated for str, including the zero 
   }; 
 
+// The smallest buffer we allocate. Most strings grow, so there's no
+//  point starting smaller than this.
+#define KMSSTRING_MIN_CAP 64
+
+
+/*==========================================================================
+kmsstring_grow 
+Make sure there is room for at least 'extra' more bytes, plus the 
+terminating zero. The buffer at least doubles each time it has to grow,
+so a string built up by appending costs time in proportion to its
+final length.
+*==========================================================================*/
+static void kmsstring_grow (KMSString *self, size_t extra)
+  {
+  size_t need = self->len + extra + 1;
+  if (need <= self->cap) return;
+  size_t cap = self->cap * 2;
+  if (cap < KMSSTRING_MIN_CAP) cap = KMSSTRING_MIN_CAP;
+  if (cap < need) cap = need;
+  self->str = realloc (self->str, cap);
+  self->cap = cap;
+  }
+
 
 /*==========================================================================
 kmsstring_create_empty 
@@ -41,11 +66,39 @@ kmsstring_create
 KMSString *kmsstring_create (const char *s)
   {
   KMSString *self = malloc (sizeof (KMSString));
-  self->str = strdup (s);
+  self->str = NULL;
+  self->len = 0;
+  self->cap = 0;
+  kmsstring_append_n (self, s, strlen (s));
   return self;
   }
 
 
+/*==========================================================================
+kmsstring_reserve
+Make sure the string can grow to 'size' bytes without reallocation
+*==========================================================================*/
+void kmsstring_reserve (KMSString *self, size_t size)
+  {
+  if (size > self->len) 
+    kmsstring_grow (self, size - self->len);
+  }
+
+
+/*==========================================================================
+kmsstring_detach
+Destroy the KMSString, and return its contents to the caller, who
+must eventually free it. This saves the caller making a copy of the
+contents just before destroying the string.
+*==========================================================================*/
+char *kmsstring_detach (KMSString *self)
+  {
+  char *ret = self->str;
+  free (self);
+  return ret;
+  }
+
+
 /*==========================================================================
 kmsstring_destroy
 *==========================================================================*/
@@ -85,16 +138,46 @@ const char *kmsstring_cstr_safe (const KMSString *self)
   }
 
 
+/*==========================================================================
+kmsstring_append_n
+Append exactly n bytes from s, which need not be zero-terminated
+*==========================================================================*/
+void kmsstring_append_n (KMSString *self, const char *s, size_t n) 
+  {
+  kmsstring_grow (self, n);
+  memcpy (self->str + self->len, s, n);
+  self->len += n;
+  self->str[self->len] = 0;
+  }
+
+
+/*==========================================================================
+kmsstring_append_long
+Append a number in decimal; much quicker than kmsstring_append_printf, 
+for something that is done for every chapter of a book
+*==========================================================================*/
+void kmsstring_append_long (KMSString *self, long n) 
+  {
+  char buff[24];
+  char *p = buff + sizeof (buff);
+  unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+  do
+    {
+    *--p = '0' + u % 10;
+    u /= 10;
+    } while (u);
+  if (n < 0) *--p = '-';
+  kmsstring_append_n (self, p, buff + sizeof (buff) - p);
+  }
+
+
 /*==========================================================================
 kmsstring_append
 *==========================================================================*/
 void kmsstring_append (KMSString *self, const char *s) 
   {
   if (!s) return;
-  if (self->str == NULL) self->str = strdup ("");
-  int newlen = strlen (self->str) + strlen (s) + 2;
-  self->str = realloc (self->str, newlen);
-  strcat (self->str, s);
+  kmsstring_append_n (self, s, strlen (s));
   }
 
 
@@ -103,12 +186,9 @@ kmsstring_append_c
 *==========================================================================*/
 void kmsstring_append_c (KMSString *self, const char c) 
   {
-  if (self->str == NULL) self->str = strdup ("");
-  int oldlen = strlen (self->str);
-  int newlen = oldlen + 1;
-  self->str = realloc (self->str, newlen + 1);
-  self->str[oldlen] = c;
-  self->str[newlen] = 0; 
+  kmsstring_grow (self, 1);
+  self->str[self->len++] = c;
+  self->str[self->len] = 0; 
   }
 
 
@@ -118,14 +198,11 @@ kmsstring_prepend
 void kmsstring_prepend (KMSString *self, const char *s) 
   {
   if (!s) return;
-  if (self->str == NULL) self->str = strdup ("");
-  int newlen = strlen (self->str) + strlen (s) + 2;
-  char *temp = strdup (self->str); 
-  free (self->str);
-  self->str = malloc (newlen);
-  strcpy (self->str, s);
-  strcat (self->str, temp);
-  free (temp);
+  size_t n = strlen (s);
+  kmsstring_grow (self, n);
+  memmove (self->str + n, self->str, self->len + 1);
+  memcpy (self->str, s, n);
+  self->len += n;
   }
 
 
@@ -134,25 +211,31 @@ kmsstring_append_printf
 *==========================================================================*/
 void kmsstring_append_printf (KMSString *self, const char *fmt,...) 
   {
-  if (self->str == NULL) self->str = strdup ("");
   va_list ap;
   va_start (ap, fmt);
-  char *s;
-  vasprintf (&s, fmt, ap);
-  kmsstring_append (self, s);
-  free (s);
+  int n = vsnprintf (self->str + self->len, self->cap - self->len, fmt, ap);
   va_end (ap);
+  if (n < 0) return;
+  if (self->len + n + 1 > self->cap)
+    {
+    // It didn't fit -- now we know how big it is, so make room and
+    //  try again
+    kmsstring_grow (self, n);
+    va_start (ap, fmt);
+    vsnprintf (self->str + self->len, self->cap - self->len, fmt, ap);
+    va_end (ap);
+    }
+  self->len += n;
   }
 
 
 /*==========================================================================
 kmsstring_length
 *==========================================================================*/
-int kmsstring_length (const KMSString *self)
+size_t kmsstring_length (const KMSString *self)
   {
   if (self == NULL) return 0;
-  if (self->str == NULL) return 0;
-  return strlen (self->str);
+  return self->len;
   }
 
 
@@ -162,8 +245,9 @@ kmsstring_clone
 KMSString *kmsstring_clone (const KMSString *self)
   {
   if (!self) return NULL;
-  if (!self->str) return kmsstring_create_empty();
-  return kmsstring_create (kmsstring_cstr (self));
+  KMSString *ret = kmsstring_create_empty ();
+  kmsstring_append_n (ret, self->str, self->len);
+  return ret;
   }
 
 
@@ -187,17 +271,11 @@ kmsstring_delete
 *==========================================================================*/
 void kmsstring_delete (KMSString *self, const int pos, const int len)
   {
-  char *str = self->str;
-  if (pos + len > strlen (str))
-    kmsstring_delete (self, pos, strlen(str) - len);
-  else
-    {
-    char *buff = malloc (strlen (str) - len + 2);
-    strncpy (buff, str, pos); 
-    strcpy (buff + pos, str + pos + len);
-    free (self->str);
-    self->str = buff;
-    }
+  if (pos >= self->len) return;
+  int n = len;
+  if (pos + n > self->len) n = self->len - pos;
+  memmove (self->str + pos, self->str + pos + n, self->len - pos - n + 1);
+  self->len -= n;
   }
 
 
@@ -207,14 +285,11 @@ kmsstring_insert
 void kmsstring_insert (KMSString *self, const int pos, 
     const char *replace)
   {
-  char *buff = malloc (strlen (self->str) + strlen (replace) + 2);
-  char *str = self->str;
-  strncpy (buff, str, pos);
-  buff[pos] = 0;
-  strcat (buff, replace);
-  strcat (buff, str + pos); 
-  free (self->str);
-  self->str = buff;
+  size_t n = strlen (replace);
+  kmsstring_grow (self, n);
+  memmove (self->str + pos + n, self->str + pos, self->len - pos + 1);
+  memcpy (self->str + pos, replace, n);
+  self->len += n;
   }
 
 /*==========================================================================
@@ -283,6 +358,8 @@ void kmsstring_substitute_all_in_place (KMSString *self,
   char *s = self->str;
   char *s2 = kmsstring_replace_helper (s, search, replace);
   self->str = s2;
+  self->len = strlen (s2);
+  self->cap = self->len + 1;
   free (s);
   }
 
@@ -295,18 +372,40 @@ BOOL kmsstring_create_from_utf8_file (const char *filename,
   KMSString *self = NULL;
   BOOL ok = FALSE; 
   int f = open (filename, O_RDONLY);
-  if (f > 0)
+  if (f >= 0)
     {
-    self = malloc (sizeof (KMSString));
     struct stat sb;
     fstat (f, &sb);
     int64_t size = sb.st_size;
     char *buff = malloc (size + 2);
-    read (f, buff, size);
-    self->str = buff; 
-    self->str[size] = 0;
-    *result = self;
-    ok = TRUE;
+    // read() can return less than we ask for, so keep going until we
+    //  have the whole file, or it turns out to be shorter than fstat said
+    int64_t got = 0;
+    ssize_t n = 0;
+    while (got < size)
+      {
+      n = read (f, buff + got, size - got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += n;
+      }
+    if (n >= 0)
+      {
+      self = malloc (sizeof (KMSString));
+      self->str = buff; 
+      self->str[got] = 0;
+      self->len = got;
+      self->cap = size + 2;
+      *result = self;
+      ok = TRUE;
+      }
+    else
+      {
+      asprintf (error, "Can't read file '%s': %s", 
+        filename, strerror (errno));
+      free (buff);
+      }
+    close (f);
     }
   else
     {
@@ -347,11 +446,173 @@ KMSString *kmsstring_encode_url (const char *str)
     pstr++;
     }
   *pbuf = '\0';
-  KMSString *result = kmsstring_create (buf);
-  free (buf);
+  KMSString *result = malloc (sizeof (KMSString));
+  result->str = buf;
+  result->len = pbuf - buf;
+  result->cap = strlen (str) * 3 + 1;
   return (result);
   }
 
 
 
 
+
+
+/*==========================================================================
+  kmsstring_truncate
+  Shorten the string to len bytes. The buffer is kept, so the string 
+  can be refilled without allocating memory.
+*==========================================================================*/
+void kmsstring_truncate (KMSString *self, size_t len)
+  {
+  if (len < self->len)
+    {
+    self->len = len;
+    self->str[len] = 0;
+    }
+  }
+
+
+/*==========================================================================
+  kmsstring_append_begin
+  Return a pointer to the end of the string, with room for at least max
+  bytes to be written there. The caller must then call 
+  kmsstring_append_end, to say how many bytes it actually wrote. This 
+  lets a formatter write straight into the string.
+*==========================================================================*/
+char *kmsstring_append_begin (KMSString *self, size_t max)
+  {
+  kmsstring_grow (self, max);
+  return self->str + self->len;
+  }
+
+
+/*==========================================================================
+  kmsstring_append_end
+*==========================================================================*/
+void kmsstring_append_end (KMSString *self, size_t n)
+  {
+  self->len += n;
+  self->str[self->len] = 0;
+  }
+
+
+/*==========================================================================
+  kmsstring_view
+  A view of the whole string, valid until the string is next changed.
+  Views have int lengths, so this is only for strings shorter than 
+  INT_MAX; use kmsstring_cstr and kmsstring_length for any other.
+*==========================================================================*/
+KMSStringView kmsstring_view (const KMSString *self)
+  {
+  return kmsstringview_create (self->str, self->len);
+  }
+
+
+/*==========================================================================
+  kmsstring_append_view
+*==========================================================================*/
+void kmsstring_append_view (KMSString *self, KMSStringView v)
+  {
+  kmsstring_append_n (self, v.str, v.len);
+  }
+
+
+/*==========================================================================
+  kmsstringview_create
+*==========================================================================*/
+KMSStringView kmsstringview_create (const char *s, int len)
+  {
+  KMSStringView v;
+  v.str = s;
+  v.len = len;
+  return v;
+  }
+
+
+/*==========================================================================
+  kmsstringview_create_cstr
+*==========================================================================*/
+KMSStringView kmsstringview_create_cstr (const char *s)
+  {
+  return kmsstringview_create (s, strlen (s));
+  }
+
+
+/*==========================================================================
+  kmsstringview_find_c
+  Returns the offset of the first c in the view, or -1
+*==========================================================================*/
+int kmsstringview_find_c (KMSStringView self, char c)
+  {
+  const char *p = memchr (self.str, c, self.len);
+  if (p)
+    return p - self.str;
+  else
+    return -1;
+  }
+
+
+/*==========================================================================
+  kmsstringview_find
+  Returns the offset of the first occurrence of search in the view, or -1
+*==========================================================================*/
+int kmsstringview_find (KMSStringView self, KMSStringView search)
+  {
+  const char *p = memmem (self.str, self.len, search.str, search.len);
+  if (p)
+    return p - self.str;
+  else
+    return -1;
+  }
+
+
+/*==========================================================================
+  kmsstringview_compare
+  Compares like strcmp, except that the views may contain zeros
+*==========================================================================*/
+int kmsstringview_compare (KMSStringView self, KMSStringView other)
+  {
+  int n = self.len < other.len ? self.len : other.len;
+  int ret = memcmp (self.str, other.str, n);
+  if (ret == 0) 
+    ret = (self.len > other.len) - (self.len < other.len);
+  return ret;
+  }
+
+
+/*==========================================================================
+  kmsstringview_starts_with
+*==========================================================================*/
+BOOL kmsstringview_starts_with (KMSStringView self, KMSStringView prefix)
+  {
+  return self.len >= prefix.len 
+    && memcmp (self.str, prefix.str, prefix.len) == 0;
+  }
+
+
+/*==========================================================================
+  kmsstringview_split
+  Sets head to the part of the view up to, but not including, the first
+  sep, and advances the view past the sep. If there is no sep, head is 
+  the whole of what's left, and the view becomes empty. Returns FALSE 
+  when there is nothing left to split.
+*==========================================================================*/
+BOOL kmsstringview_split (KMSStringView *self, char sep, KMSStringView *head)
+  {
+  if (self->len <= 0) return FALSE;
+  int i = kmsstringview_find_c (*self, sep);
+  if (i < 0)
+    {
+    *head = *self;
+    self->str += self->len;
+    self->len = 0;
+    }
+  else
+    {
+    *head = kmsstringview_create (self->str, i);
+    self->str += i + 1;
+    self->len -= i + 1;
+    }
+  return TRUE;
+  }
@@ -11,6 +11,15 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 struct _KMSString;
 typedef struct _KMSString KMSString;
 
+// A KMSStringView is a non-owning reference to len bytes starting at
+//  str. It is not zero-terminated, and is only valid as long as the
+//  memory it refers to. Views are small, so they are passed by value.
+typedef struct _KMSStringView
+  {
+  const char *str;
+  int len;
+  } KMSStringView;
+
 #ifdef __cplusplus 
 extern "C" {
 #endif
@@ -25,8 +34,13 @@ const char   *kmsstring_cstr_safe (const KMSString *self);
 void         kmsstring_append_printf (KMSString *self, const char *fmt,...);
 void         kmsstring_append (KMSString *self, const char *s);
 void         kmsstring_append_c (KMSString *self, const char c);
+void         kmsstring_append_n (KMSString *self, const char *s, 
+                size_t n);
+void         kmsstring_append_long (KMSString *self, long n);
+void         kmsstring_reserve (KMSString *self, size_t size);
+char         *kmsstring_detach (KMSString *self);
 void         kmsstring_prepend (KMSString *self, const char *s);
-int          kmsstring_length (const KMSString *self);
+size_t       kmsstring_length (const KMSString *self);
 KMSString    *kmsstring_substitute_all (const KMSString *self, 
                 const char *search, const char *replace);
 void         kmsstring_substitute_all_in_place (KMSString *self, 
@@ -38,6 +52,21 @@ void         kmsstring_insert (KMSString *self, const int pos,
 BOOL         kmsstring_create_from_utf8_file (const char *filename, 
                 KMSString **result, char **error);
 KMSString    *kmsstring_encode_url (const char *s);
+void         kmsstring_truncate (KMSString *self, size_t len);
+char         *kmsstring_append_begin (KMSString *self, size_t max);
+void         kmsstring_append_end (KMSString *self, size_t n);
+KMSStringView kmsstring_view (const KMSString *self);
+void         kmsstring_append_view (KMSString *self, KMSStringView v);
+
+KMSStringView kmsstringview_create (const char *s, int len);
+KMSStringView kmsstringview_create_cstr (const char *s);
+int          kmsstringview_find_c (KMSStringView self, char c);
+int          kmsstringview_find (KMSStringView self, KMSStringView search);
+int          kmsstringview_compare (KMSStringView self, KMSStringView other);
+BOOL         kmsstringview_starts_with (KMSStringView self, 
+                KMSStringView prefix);
+BOOL         kmsstringview_split (KMSStringView *self, char sep, 
+                KMSStringView *head);
 
 #ifdef __cplusplus 
 }
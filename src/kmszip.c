@@ -0,0 +1,1170 @@
+/*==========================================================================
+txt2epub
+kmszip.c
+A simple ZIP archive writer, using zlib for compression
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
+#include "kmscrc.h"
+#include "kmslogging.h"
+#include "kmsparallel.h"
+#include "kmszip.h"
+
+#define KMSZIP_LOCAL_SIG   0x04034b50
+#define KMSZIP_CENTRAL_SIG 0x02014b50
+#define KMSZIP_END_SIG     0x06054b50
+#define KMSZIP_END64_SIG   0x06064b50
+#define KMSZIP_LOC64_SIG   0x07064b50
+#define KMSZIP_DESC_SIG    0x08074b50
+#define KMSZIP_STORED      0
+#define KMSZIP_DEFLATED    8
+// Version 2.0 is enough for deflate; the high byte says 'Unix', so 
+//  readers take notice of the file permissions 
+#define KMSZIP_VERSION     20
+#define KMSZIP_VERSION64   45
+#define KMSZIP_MADE_BY     (0x0300 | KMSZIP_VERSION64)
+// Header fields that don't fit are set to these, and the real values go
+//  in a ZIP64 extra field 
+#define KMSZIP_MAX16       0xFFFF
+#define KMSZIP_MAX32       0xFFFFFFFFu
+#define KMSZIP_ZIP64_ID    0x0001
+// Compressed data is written in pieces of this size, when an entry is
+//  written a piece at a time
+#define KMSZIP_OUT_SIZE    65536
+// A block deflated on its own is primed with this much of the data 
+//  before it -- as far back as deflate can refer
+#define KMSZIP_DICT_SIZE   32768
+// With --rsyncable, deflate starts afresh after any byte where the sum
+//  of the last KMSZIP_RSYNC_WIN bytes is a multiple of KMSZIP_RSYNC_MOD,
+//  as gzip --rsyncable does, but at least KMSZIP_RSYNC_WIN bytes after 
+//  the last such place. Where the text is the same, so are the places 
+//  and what is between them, whatever came earlier
+#define KMSZIP_RSYNC_WIN   4096
+#define KMSZIP_RSYNC_MOD   8192
+// General purpose flags: the CRC and sizes are in a data descriptor 
+//  after the data, rather than in the local header; the name is UTF-8 
+#define KMSZIP_FLAG_DESC   0x0008 
+#define KMSZIP_FLAG_UTF8   0x0800 
+
+typedef struct _KMSZipRsync
+  {
+  unsigned char win[KMSZIP_RSYNC_WIN]; // The last bytes, round and round
+  uint64_t pos;             // Bytes seen so far
+  uint32_t sum;             // Of the bytes in win
+  size_t seg;               // Bytes since the last reset
+  size_t max;               // Reset after this many, whatever the sum
+  } KMSZipRsync;
+
+typedef struct _KMSZipEntry
+  {
+  char *name;
+  uint16_t method;
+  uint16_t flags;
+  uint32_t crc;
+  uint64_t clen;
+  uint64_t len;
+  uint64_t offset;
+  BOOL zip64;               // The local header has a ZIP64 extra field
+  } KMSZipEntry;
+
+struct _KMSZip
+  {
+  FILE *f;
+  BOOL failed;
+  BOOL seekable;            // Local headers can be patched afterwards
+  off_t base;               // Where in f the archive starts
+  uint64_t offset;          // Bytes written so far
+  uint16_t dos_time;
+  uint16_t dos_date;
+  KMSZipEntry *entries;
+  int n;
+  int cap;
+  // The last entry may be open, and being written a piece at a time
+  BOOL open;
+  z_stream zs;
+  unsigned char *zout;
+  // Deflated entries are rsyncable; for an open entry, where the next 
+  //  reset will be, and whether one is due before any more input
+  BOOL rsyncable;
+  size_t rsync_max;
+  KMSZipRsync *rsync;
+  BOOL reset_due;
+  // An open entry begun by kmszip_entry_begin_stored already has its
+  //  size and CRC in its local header
+  BOOL known;
+  uint64_t known_len;
+  uint32_t known_crc;
+  };
+
+
+/*==========================================================================
+kmszip_put16, kmszip_put32
+ZIP headers are little-endian, whatever the platform
+*==========================================================================*/
+static unsigned char *kmszip_put16 (unsigned char *p, uint16_t v)
+  {
+  p[0] = v; p[1] = v >> 8;
+  return p + 2;
+  }
+
+static unsigned char *kmszip_put32 (unsigned char *p, uint32_t v)
+  {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+  return p + 4;
+  }
+
+static unsigned char *kmszip_put64 (unsigned char *p, uint64_t v)
+  {
+  p = kmszip_put32 (p, (uint32_t)v);
+  return kmszip_put32 (p, (uint32_t)(v >> 32));
+  }
+
+static uint32_t kmszip_clamp32 (uint64_t v)
+  {
+  return v >= KMSZIP_MAX32 ? KMSZIP_MAX32 : (uint32_t)v;
+  }
+
+
+/*==========================================================================
+kmszip_write
+*==========================================================================*/
+static BOOL kmszip_write (KMSZip *self, const void *data, size_t len)
+  {
+  if (self->failed) return FALSE;
+  if (len > 0 && fwrite (data, 1, len, self->f) != len)
+    {
+    self->failed = TRUE;
+    return FALSE;
+    }
+  self->offset += len;
+  return TRUE;
+  }
+
+
+/*==========================================================================
+kmszip_dos_time
+Set the time for every entry, as MS-DOS has it: two-second resolution,
+and nothing before 1980
+*==========================================================================*/
+static void kmszip_dos_time (KMSZip *self, struct tm *tm)
+  {
+  if (tm->tm_year < 80) 
+    {
+    tm->tm_year = 80;
+    tm->tm_mon = 0;
+    tm->tm_mday = 1;
+    tm->tm_hour = tm->tm_min = tm->tm_sec = 0;
+    }
+  self->dos_time = (tm->tm_hour << 11) | (tm->tm_min << 5) 
+     | (tm->tm_sec / 2);
+  self->dos_date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) 
+     | tm->tm_mday;
+  }
+
+
+/*==========================================================================
+kmszip_create
+Returns NULL, with errno set, if the file can't be created
+*==========================================================================*/
+KMSZip *kmszip_create (const char *filename)
+  {
+  FILE *f = fopen (filename, "wb");
+  if (!f) return NULL;
+  return kmszip_create_file (f);
+  }
+
+
+/*==========================================================================
+kmszip_create_file
+Write an archive to a stream that is already open, from its current 
+position. kmszip_close closes it. If the stream can't seek -- a pipe,
+for example -- entries written by kmszip_entry_begin, etc., get data
+descriptors, since their headers can't be filled in afterwards.
+*==========================================================================*/
+KMSZip *kmszip_create_file (FILE *f)
+  {
+  KMSZip *self = malloc (sizeof (KMSZip));
+  memset (self, 0, sizeof (KMSZip));
+  self->f = f;
+  self->base = ftello (f);
+  // In append mode, every write goes to the end, seeking or not
+  int flags = fcntl (fileno (f), F_GETFL);
+  self->seekable = self->base >= 0 && flags >= 0 && !(flags & O_APPEND)
+    && fseeko (f, self->base, SEEK_SET) == 0;
+  if (!self->seekable) self->base = 0;
+
+  // Every entry gets the time the archive was created, unless 
+  //  kmszip_set_time says otherwise
+  time_t now = time (NULL);
+  struct tm tm;
+  localtime_r (&now, &tm);
+  kmszip_dos_time (self, &tm);
+  return self;
+  }
+
+
+/*==========================================================================
+kmszip_set_time
+Give every entry this time, rather than the time now. ZIP times have no
+time zone, so this one is taken as UTC, to be the same wherever the
+archive is made. Times before 1980 can't be represented, and become 
+1980-01-01.
+*==========================================================================*/
+void kmszip_set_time (KMSZip *self, time_t t)
+  {
+  struct tm tm;
+  gmtime_r (&t, &tm);
+  kmszip_dos_time (self, &tm);
+  }
+
+
+/*==========================================================================
+kmszip_set_rsyncable
+From now on, deflate entries in blocks that end at places that depend
+only on the text, and are no more than max bytes apart (or 1GB, if max
+is 0). See kmszip_deflate_rsyncable. 
+*==========================================================================*/
+void kmszip_set_rsyncable (KMSZip *self, size_t max)
+  {
+  self->rsyncable = TRUE;
+  self->rsync_max = max;
+  }
+
+
+/*==========================================================================
+kmszip_new_entry
+*==========================================================================*/
+static KMSZipEntry *kmszip_new_entry (KMSZip *self, const char *name, 
+    uint16_t method)
+  {
+  if (self->n == self->cap)
+    {
+    self->cap = self->cap * 2 + 16;
+    self->entries = realloc (self->entries, 
+      self->cap * sizeof (KMSZipEntry));
+    }
+  KMSZipEntry *e = &self->entries[self->n++];
+  memset (e, 0, sizeof (KMSZipEntry));
+  e->name = strdup (name);
+  e->method = method;
+  const char *p;
+  for (p = name; *p; p++)
+    if (*p & 0x80) e->flags = KMSZIP_FLAG_UTF8;
+  e->offset = self->offset;
+  return e;
+  }
+
+
+/*==========================================================================
+kmszip_local_header
+Write the local header for an entry into h, which must have room for
+KMSZIP_LOCAL_MAX bytes plus the name. Returns the length. 
+*==========================================================================*/
+#define KMSZIP_LOCAL_MAX (30 + 20)
+static size_t kmszip_local_header (const KMSZip *self, 
+    const KMSZipEntry *e, unsigned char *h)
+  {
+  size_t name_len = strlen (e->name);
+  unsigned char *q = h;
+  q = kmszip_put32 (q, KMSZIP_LOCAL_SIG);
+  q = kmszip_put16 (q, e->zip64 ? KMSZIP_VERSION64 : KMSZIP_VERSION);
+  q = kmszip_put16 (q, e->flags);
+  q = kmszip_put16 (q, e->method);
+  q = kmszip_put16 (q, self->dos_time);
+  q = kmszip_put16 (q, self->dos_date);
+  q = kmszip_put32 (q, e->crc);
+  q = kmszip_put32 (q, e->zip64 ? KMSZIP_MAX32 : e->clen);
+  q = kmszip_put32 (q, e->zip64 ? KMSZIP_MAX32 : e->len);
+  q = kmszip_put16 (q, name_len);
+  q = kmszip_put16 (q, e->zip64 ? 20 : 0);
+  memcpy (q, e->name, name_len);
+  q += name_len;
+  if (e->zip64)
+    {
+    q = kmszip_put16 (q, KMSZIP_ZIP64_ID);
+    q = kmszip_put16 (q, 16);
+    q = kmszip_put64 (q, e->len);
+    q = kmszip_put64 (q, e->clen);
+    }
+  return q - h;
+  }
+
+
+/*==========================================================================
+kmszip_write_local_header
+*==========================================================================*/
+static BOOL kmszip_write_local_header (KMSZip *self, const KMSZipEntry *e)
+  {
+  unsigned char *h = malloc (KMSZIP_LOCAL_MAX + strlen (e->name));
+  BOOL ret = kmszip_write (self, h, kmszip_local_header (self, e, h));
+  free (h);
+  return ret;
+  }
+
+
+/*==========================================================================
+kmszip_add_entry
+Add an entry whose data is all available now
+*==========================================================================*/
+static BOOL kmszip_add_entry (KMSZip *self, const char *name, 
+    uint16_t method, const void *data, size_t clen, size_t len, 
+    uint32_t crc)
+  {
+  if (self->failed) return FALSE;
+  if (self->open) kmszip_entry_end (self);
+  KMSZipEntry *e = kmszip_new_entry (self, name, method);
+  e->crc = crc;
+  e->clen = clen;
+  e->len = len;
+  e->zip64 = (len >= KMSZIP_MAX32 || clen >= KMSZIP_MAX32);
+  return kmszip_write_local_header (self, e) 
+    && kmszip_write (self, data, clen);
+  }
+
+
+/*==========================================================================
+KMSZipTry
+At KMSZIP_MAX, data is deflated with each of these settings in turn,
+and the smallest result kept. Level 9 does not always beat the default
+level, especially on small entries, and Z_FILTERED sometimes wins on 
+text with few long repeats. The first is used when there's only one
+chance. 
+*==========================================================================*/
+typedef struct _KMSZipTry
+  {
+  int level;
+  int mem_level;
+  int strategy;
+  } KMSZipTry;
+
+static const KMSZipTry kmszip_max_tries[] = 
+  {
+  { 9, 9, Z_DEFAULT_STRATEGY },
+  { 9, 9, Z_FILTERED },
+  { Z_DEFAULT_COMPRESSION, 8, Z_DEFAULT_STRATEGY },
+  };
+#define KMSZIP_MAX_TRIES \
+  (int)(sizeof (kmszip_max_tries) / sizeof (kmszip_max_tries[0]))
+
+
+/*==========================================================================
+kmszip_deflate_init
+Set up zs for a raw deflate stream, at a zlib compression level, or
+with try k of KMSZIP_MAX
+*==========================================================================*/
+static void kmszip_deflate_init (z_stream *zs, int level, int k)
+  {
+  memset (zs, 0, sizeof (z_stream));
+  // Negative window bits mean no zlib header or trailer, which is 
+  //  what ZIP wants
+  if (level == KMSZIP_MAX)
+    deflateInit2 (zs, kmszip_max_tries[k].level, Z_DEFLATED, -MAX_WBITS, 
+      kmszip_max_tries[k].mem_level, kmszip_max_tries[k].strategy);
+  else
+    deflateInit2 (zs, level, Z_DEFLATED, -MAX_WBITS, 8, 
+      Z_DEFAULT_STRATEGY);
+  }
+
+
+/*==========================================================================
+kmszip_tries
+How many ways to try compressing at a level
+*==========================================================================*/
+static int kmszip_tries (int level)
+  {
+  return level == KMSZIP_MAX ? KMSZIP_MAX_TRIES : 1;
+  }
+
+
+/*==========================================================================
+kmszip_deflate_with
+Compress len bytes of data as a raw deflate stream, with try k. Returns
+NULL if deflate fails.
+*==========================================================================*/
+static void *kmszip_deflate_with (const void *data, size_t len, int level, 
+    int k, size_t *clen)
+  {
+  z_stream zs;
+  kmszip_deflate_init (&zs, level, k);
+  size_t bound = deflateBound (&zs, len);
+  unsigned char *out = malloc (bound);
+
+  // avail_in and avail_out are only 32 bits, so large inputs are fed in
+  //  pieces. Incompressible input can fill a piece of output before it
+  //  uses up its piece of input, so each is topped up separately, when
+  //  deflate has used it all. 
+  const size_t step = 1 << 30;
+  size_t done = 0;
+  int ret = Z_OK;
+  zs.next_out = out;
+  while (ret == Z_OK)
+    {
+    if (zs.avail_in == 0)
+      {
+      size_t in = len - done < step ? len - done : step;
+      zs.next_in = (Bytef *)data + done;
+      zs.avail_in = in;
+      done += in;
+      }
+    if (zs.avail_out == 0)
+      zs.avail_out = bound - zs.total_out < step ? 
+        bound - zs.total_out : step;
+    ret = deflate (&zs, done == len ? Z_FINISH : Z_NO_FLUSH);
+    }
+  *clen = zs.total_out;
+  deflateEnd (&zs);
+  if (ret != Z_STREAM_END)
+    {
+    kmslog_error ("Can't compress data: zlib error %d", ret);
+    free (out);
+    return NULL;
+    }
+  return out;
+  }
+
+
+/*==========================================================================
+kmszip_deflate
+Compress len bytes of data as a raw deflate stream, at the zlib 
+compression level given, or KMSZIP_MAX. Returns a buffer that the 
+caller must free, and sets clen to the amount of data in it, or 
+returns NULL if deflate fails.
+*==========================================================================*/
+void *kmszip_deflate (const void *data, size_t len, int level, 
+    size_t *clen)
+  {
+  void *best = kmszip_deflate_with (data, len, level, 0, clen);
+  int k;
+  for (k = 1; best && k < kmszip_tries (level); k++)
+    {
+    size_t n;
+    void *out = kmszip_deflate_with (data, len, level, k, &n);
+    if (!out)
+      {
+      free (best);
+      return NULL;
+      }
+    if (n < *clen)
+      {
+      free (best);
+      best = out;
+      *clen = n;
+      }
+    else
+      free (out);
+    }
+  return best;
+  }
+
+
+/*==========================================================================
+kmszip_deflate_block
+Deflate one block of a KMSZipBlocks, for kmsparallel_for. Block i is
+the data from start[i] to start[i + 1].
+*==========================================================================*/
+typedef struct _KMSZipBlocks
+  {
+  const unsigned char *data;
+  size_t len;
+  const size_t *start;
+  int level;
+  unsigned char **out;
+  size_t *olen;
+  uint32_t *crc;
+  } KMSZipBlocks;
+
+static unsigned char *kmszip_deflate_block_with (const KMSZipBlocks *b, 
+    int i, int k, size_t *olen)
+  {
+  size_t start = b->start[i];
+  size_t n = b->start[i + 1] - start;
+  BOOL last = start + n == b->len;
+
+  z_stream zs;
+  kmszip_deflate_init (&zs, b->level, k);
+  int ret = Z_OK;
+  if (i > 0)
+    {
+    size_t dict = start < KMSZIP_DICT_SIZE ? start : KMSZIP_DICT_SIZE;
+    ret = deflateSetDictionary (&zs, b->data + start - dict, dict);
+    }
+  // A sync flush ends the block on a byte boundary, without marking it 
+  //  as the last, so the next block's output can follow it directly. 
+  //  The flush adds a few bytes to what deflateBound allows for
+  size_t bound = deflateBound (&zs, n) + 16;
+  unsigned char *out = malloc (bound);
+  zs.next_in = (Bytef *)b->data + start;
+  zs.avail_in = n;
+  zs.next_out = out;
+  zs.avail_out = bound;
+  if (ret == Z_OK)
+    ret = deflate (&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+  // A flush is only complete if it left some room in the output
+  BOOL done = last ? ret == Z_STREAM_END 
+    : ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0;
+  *olen = zs.total_out;
+  deflateEnd (&zs);
+  if (!done)
+    {
+    kmslog_error ("Can't compress block %d: zlib error %d", i, ret);
+    free (out);
+    return NULL;
+    }
+  return out;
+  }
+
+static void kmszip_deflate_block (int i, void *arg)
+  {
+  KMSZipBlocks *b = arg;
+  b->out[i] = kmszip_deflate_block_with (b, i, 0, &b->olen[i]);
+  int k;
+  for (k = 1; b->out[i] && k < kmszip_tries (b->level); k++)
+    {
+    size_t n;
+    unsigned char *out = kmszip_deflate_block_with (b, i, k, &n);
+    if (!out)
+      {
+      free (b->out[i]);
+      b->out[i] = NULL;
+      }
+    else if (n < b->olen[i])
+      {
+      free (b->out[i]);
+      b->out[i] = out;
+      b->olen[i] = n;
+      }
+    else
+      free (out);
+    }
+  if (b->crc)
+    b->crc[i] = kmszip_crc (b->data + b->start[i], 
+      b->start[i + 1] - b->start[i]);
+  }
+
+
+/*==========================================================================
+kmszip_deflate_starts
+Deflate the n blocks that start at the given offsets, on up to 'jobs'
+threads, and join them into one stream; start[n] is len. Returns NULL
+if any block could not be deflated.
+*==========================================================================*/
+static void *kmszip_deflate_starts (const void *data, size_t len, 
+    int level, const size_t *start, int n, int jobs, size_t *clen, 
+    uint32_t *crc)
+  {
+  KMSZipBlocks b = { data, len, start, level };
+  b.out = malloc (n * sizeof (unsigned char *));
+  b.olen = malloc (n * sizeof (size_t));
+  b.crc = crc ? malloc (n * sizeof (uint32_t)) : NULL;
+  kmsparallel_for (jobs, n, kmszip_deflate_block, &b);
+
+  size_t total = 0;
+  BOOL failed = FALSE;
+  int i;
+  for (i = 0; i < n; i++)
+    {
+    total += b.olen[i];
+    if (!b.out[i]) failed = TRUE;
+    }
+  unsigned char *out = failed ? NULL : malloc (total), *q = out;
+  if (crc) *crc = b.crc[0];
+  for (i = 0; i < n; i++)
+    {
+    if (out)
+      q = mempcpy (q, b.out[i], b.olen[i]);
+    free (b.out[i]);
+    if (crc && i > 0)
+      *crc = kmscrc_combine (*crc, b.crc[i], start[i + 1] - start[i]);
+    }
+  *clen = total;
+  free (b.out);
+  free (b.olen);
+  free (b.crc);
+  return out;
+  }
+
+
+/*==========================================================================
+kmszip_deflate_blocks
+Like kmszip_deflate, but divide the data into blocks of the given size,
+and compress them on up to 'jobs' threads, joining the results into a
+single deflate stream, as pigz does. Each block uses the end of the 
+one before as a dictionary, so little compression is lost. Unless crc
+is NULL, also sets it to the CRC-32 of the data, which is worked out a 
+block at a time. 
+The output depends on the block size, but not on the number of jobs. 
+With block 0, or no more than block bytes of data, this is just 
+kmszip_deflate. Blocks must be smaller than 1GB.
+*==========================================================================*/
+void *kmszip_deflate_blocks (const void *data, size_t len, int level, 
+    size_t block, int jobs, size_t *clen, uint32_t *crc)
+  {
+  if (block == 0 || len <= block)
+    {
+    if (crc) *crc = kmszip_crc (data, len);
+    return kmszip_deflate (data, len, level, clen);
+    }
+
+  int n = (len + block - 1) / block, i;
+  size_t *start = malloc ((n + 1) * sizeof (size_t));
+  for (i = 0; i < n; i++)
+    start[i] = (size_t)i * block;
+  start[n] = len;
+  void *out = kmszip_deflate_starts (data, len, level, start, n, jobs, 
+    clen, crc);
+  free (start);
+  return out;
+  }
+
+
+/*==========================================================================
+kmszip_rsync_init
+The longest run between resets is max, or 1GB if that is less, or max 
+is 0
+*==========================================================================*/
+static void kmszip_rsync_init (KMSZipRsync *r, size_t max)
+  {
+  memset (r, 0, sizeof (KMSZipRsync));
+  r->max = max == 0 || max > (1u << 30) ? (1u << 30) : max;
+  }
+
+
+/*==========================================================================
+kmszip_rsync_scan
+Look through n more bytes of data for the next place to reset deflate.
+Returns how many bytes, up to and including it, or n if there isn't 
+one. The state carries over from one call to the next, so data can be 
+scanned in pieces of any size, with the same result.
+*==========================================================================*/
+static size_t kmszip_rsync_scan (KMSZipRsync *r, const unsigned char *p, 
+    size_t n)
+  {
+  size_t i;
+  for (i = 0; i < n; i++)
+    {
+    unsigned char *w = &r->win[r->pos++ % KMSZIP_RSYNC_WIN];
+    r->sum += p[i] - *w;
+    *w = p[i];
+    r->seg++;
+    if ((r->seg >= KMSZIP_RSYNC_WIN && r->sum % KMSZIP_RSYNC_MOD == 0)
+         || r->seg == r->max)
+      {
+      r->seg = 0;
+      return i + 1;
+      }
+    }
+  return n;
+  }
+
+
+/*==========================================================================
+kmszip_deflate_rsyncable
+Like kmszip_deflate_blocks, but the blocks end at places that depend 
+only on the text around them (see KMSZIP_RSYNC_WIN), and none is 
+longer than max. If a few bytes of the data change, only the output
+for the blocks from there to 32 kB or so further on is any different,
+so rsync and the like need only send that much. The output is the same as
+an entry written a piece at a time, at the same level, once 
+kmszip_set_rsyncable has been called with the same max -- except at 
+KMSZIP_MAX, where that has only one try.
+*==========================================================================*/
+void *kmszip_deflate_rsyncable (const void *data, size_t len, int level, 
+    size_t max, int jobs, size_t *clen, uint32_t *crc)
+  {
+  KMSZipRsync r;
+  kmszip_rsync_init (&r, max);
+  int n = 0, cap = 16;
+  size_t *start = malloc (cap * sizeof (size_t));
+  size_t done = 0;
+  do
+    {
+    if (n + 1 == cap)
+      {
+      cap *= 2;
+      start = realloc (start, cap * sizeof (size_t));
+      }
+    start[n++] = done;
+    done += kmszip_rsync_scan (&r, (const unsigned char *)data + done, 
+      len - done);
+    } while (done < len);
+  start[n] = len;
+  void *out = kmszip_deflate_starts (data, len, level, start, n, jobs, 
+    clen, crc);
+  free (start);
+  return out;
+  }
+
+
+/*==========================================================================
+kmszip_crc
+The CRC-32 of len bytes of data, as ZIP requires. 
+*==========================================================================*/
+uint32_t kmszip_crc (const void *data, size_t len)
+  {
+  return kmscrc_update (0, data, len);
+  }
+
+
+/*==========================================================================
+kmszip_entry_crc
+The CRC-32 of the data of the entry added last, or 0 if there are none
+*==========================================================================*/
+uint32_t kmszip_entry_crc (const KMSZip *self)
+  {
+  return self->n > 0 ? self->entries[self->n - 1].crc : 0;
+  }
+
+
+/*==========================================================================
+kmszip_add
+Add an entry from uncompressed data. At level 0, it is stored; 
+otherwise it is deflated at that level, unless that makes it bigger
+*==========================================================================*/
+BOOL kmszip_add (KMSZip *self, const char *name, const void *data, 
+    size_t len, int level)
+  {
+  uint32_t crc = kmszip_crc (data, len);
+  if (level != 0)
+    {
+    size_t clen;
+    void *deflated = self->rsyncable 
+      ? kmszip_deflate_rsyncable (data, len, level, self->rsync_max, 1, 
+          &clen, NULL)
+      : kmszip_deflate (data, len, level, &clen);
+    if (!deflated)
+      {
+      self->failed = TRUE;
+      errno = EIO;
+      return FALSE;
+      }
+    if (clen < len)
+      {
+      BOOL ret = kmszip_add_entry (self, name, KMSZIP_DEFLATED, deflated, 
+        clen, len, crc);
+      free (deflated);
+      return ret;
+      }
+    free (deflated);
+    }
+  return kmszip_add_entry (self, name, KMSZIP_STORED, data, len, len, crc);
+  }
+
+
+/*==========================================================================
+kmszip_add_stored
+Add an entry, uncompressed, whose CRC is already known
+*==========================================================================*/
+BOOL kmszip_add_stored (KMSZip *self, const char *name, const void *data, 
+    size_t len, uint32_t crc)
+  {
+  return kmszip_add_entry (self, name, KMSZIP_STORED, data, len, len, crc);
+  }
+
+
+/*==========================================================================
+kmszip_add_deflated
+Add an entry whose data has already been deflated
+*==========================================================================*/
+BOOL kmszip_add_deflated (KMSZip *self, const char *name, 
+    const void *deflated, size_t clen, size_t len, uint32_t crc)
+  {
+  return kmszip_add_entry (self, name, KMSZIP_DEFLATED, deflated, clen, 
+    len, crc);
+  }
+
+
+/*==========================================================================
+kmszip_entry_begin
+Start an entry whose data will be supplied a piece at a time, by 
+kmszip_entry_write, so that it never has to be all in memory. The
+sizes and CRC go into the local header when the entry is finished. 
+If the entry might be 4 GB or more, before or after compression, 
+large must be TRUE, so there is room in the header for 64-bit sizes.
+If the output can't seek, the sizes and CRC go in a data descriptor
+after the data instead. A reader that reads the archive as a stream
+can only find the end of a stored entry from the sizes in its local 
+header, so on such output an entry is never stored: at level 0, it is
+deflated at level 1 instead. An entry whose size and CRC can be found 
+first can still be stored, with kmszip_entry_begin_stored.
+*==========================================================================*/
+BOOL kmszip_entry_begin (KMSZip *self, const char *name, int level, 
+    BOOL large)
+  {
+  if (self->failed) return FALSE;
+  if (self->open) kmszip_entry_end (self);
+  if (!self->seekable && level == 0)
+    level = 1;
+  KMSZipEntry *e = kmszip_new_entry (self, name, 
+    level ? KMSZIP_DEFLATED : KMSZIP_STORED);
+  e->zip64 = large;
+  e->crc = 0;
+  if (!self->seekable)
+    e->flags |= KMSZIP_FLAG_DESC;
+  self->known = FALSE;
+  if (level)
+    {
+    // There's only one chance at each piece
+    kmszip_deflate_init (&self->zs, level, 0);
+    self->zout = malloc (KMSZIP_OUT_SIZE);
+    if (self->rsyncable)
+      {
+      self->rsync = malloc (sizeof (KMSZipRsync));
+      kmszip_rsync_init (self->rsync, self->rsync_max);
+      self->reset_due = FALSE;
+      }
+    }
+  self->open = TRUE;
+  return kmszip_write_local_header (self, e);
+  }
+
+
+/*==========================================================================
+kmszip_entry_begin_stored
+Start a stored entry, whose data will be supplied a piece at a time by 
+kmszip_entry_write, when its size and CRC are known in advance -- a 
+file read twice, for example. The local header is complete, with no 
+data descriptor, even on output that can't seek, so a reader can read 
+the entry as a stream. kmszip_entry_end fails if the data written turns
+out to have a different size or CRC.
+*==========================================================================*/
+BOOL kmszip_entry_begin_stored (KMSZip *self, const char *name, 
+    uint64_t len, uint32_t crc)
+  {
+  if (self->failed) return FALSE;
+  if (self->open) kmszip_entry_end (self);
+  KMSZipEntry *e = kmszip_new_entry (self, name, KMSZIP_STORED);
+  e->zip64 = len >= KMSZIP_MAX32;
+  e->crc = crc;
+  e->clen = len;
+  e->len = len;
+  BOOL ret = kmszip_write_local_header (self, e);
+  // kmszip_entry_write counts them again from nothing
+  e->crc = 0;
+  e->clen = 0;
+  e->len = 0;
+  self->known = TRUE;
+  self->known_len = len;
+  self->known_crc = crc;
+  self->open = TRUE;
+  return ret;
+  }
+
+
+/*==========================================================================
+kmszip_entry_fail
+Give up on the open entry, because zlib reported an error, so that 
+nothing more is written to the archive
+*==========================================================================*/
+static BOOL kmszip_entry_fail (KMSZip *self, int ret)
+  {
+  kmslog_error ("Can't compress %s: zlib error %d", 
+    self->entries[self->n - 1].name, ret);
+  self->failed = TRUE;
+  errno = EIO;
+  return FALSE;
+  }
+
+
+/*==========================================================================
+kmszip_entry_deflate
+Run the deflater on whatever input it has, writing out the compressed
+data as it goes. Returns FALSE, and marks the archive as failed, if 
+zlib reports an error, or doesn't finish the stream on Z_FINISH.
+*==========================================================================*/
+static BOOL kmszip_entry_deflate (KMSZip *self, int flush)
+  {
+  KMSZipEntry *e = &self->entries[self->n - 1];
+  int ret;
+  do
+    {
+    self->zs.next_out = self->zout;
+    self->zs.avail_out = KMSZIP_OUT_SIZE;
+    ret = deflate (&self->zs, flush);
+    // Z_BUF_ERROR only means there was nothing to do
+    if (ret != Z_OK && ret != Z_BUF_ERROR 
+         && !(flush == Z_FINISH && ret == Z_STREAM_END))
+      return kmszip_entry_fail (self, ret);
+    size_t n = KMSZIP_OUT_SIZE - self->zs.avail_out;
+    if (!kmszip_write (self, self->zout, n)) return FALSE;
+    e->clen += n;
+    } while (self->zs.avail_out == 0 
+         || (flush == Z_FINISH && ret == Z_OK));
+  if (flush == Z_FINISH && ret != Z_STREAM_END)
+    return kmszip_entry_fail (self, ret);
+  return TRUE;
+  }
+
+
+/*==========================================================================
+kmszip_entry_reset
+End a block of an rsyncable entry, and start deflate again, with the 
+last 32 kB of input as its dictionary, just as kmszip_deflate_rsyncable
+does. The reset waits until there is more input, since the last block
+has to be finished differently.
+*==========================================================================*/
+static BOOL kmszip_entry_reset (KMSZip *self)
+  {
+  self->zs.avail_in = 0;
+  if (!kmszip_entry_deflate (self, Z_SYNC_FLUSH)) return FALSE;
+  unsigned char dict[KMSZIP_DICT_SIZE];
+  uInt n = sizeof (dict);
+  int ret = deflateGetDictionary (&self->zs, dict, &n);
+  if (ret == Z_OK) ret = deflateReset (&self->zs);
+  if (ret == Z_OK) ret = deflateSetDictionary (&self->zs, dict, n);
+  if (ret != Z_OK)
+    return kmszip_entry_fail (self, ret);
+  self->reset_due = FALSE;
+  return TRUE;
+  }
+
+
+/*==========================================================================
+kmszip_entry_write
+Add len bytes to the open entry
+*==========================================================================*/
+BOOL kmszip_entry_write (KMSZip *self, const void *data, size_t len)
+  {
+  if (self->failed || !self->open) return FALSE;
+  KMSZipEntry *e = &self->entries[self->n - 1];
+  e->crc = kmscrc_update (e->crc, data, len);
+  e->len += len;
+  if (e->method == KMSZIP_STORED)
+    {
+    e->clen += len;
+    return kmszip_write (self, data, len);
+    }
+
+  const Bytef *p = data;
+  while (len > 0)
+    {
+    uInt n = len > (1u << 30) ? (1u << 30) : len;
+    if (self->rsync)
+      {
+      if (self->reset_due && !kmszip_entry_reset (self)) return FALSE;
+      n = kmszip_rsync_scan (self->rsync, p, n);
+      self->reset_due = self->rsync->seg == 0;
+      }
+    self->zs.next_in = (Bytef *)p;
+    self->zs.avail_in = n;
+    if (!kmszip_entry_deflate (self, Z_NO_FLUSH)) return FALSE;
+    p += n;
+    len -= n;
+    }
+  return TRUE;
+  }
+
+
+/*==========================================================================
+kmszip_entry_end
+Finish the open entry, and go back and fill in its local header, or
+write its data descriptor
+*==========================================================================*/
+BOOL kmszip_entry_end (KMSZip *self)
+  {
+  if (!self->open) return FALSE;
+  self->open = FALSE;
+  KMSZipEntry *e = &self->entries[self->n - 1];
+  if (e->method == KMSZIP_DEFLATED)
+    {
+    self->zs.avail_in = 0;
+    kmszip_entry_deflate (self, Z_FINISH);
+    deflateEnd (&self->zs);
+    free (self->zout);
+    self->zout = NULL;
+    free (self->rsync);
+    self->rsync = NULL;
+    }
+  if (self->failed) return FALSE;
+
+  if (!e->zip64 && (e->len >= KMSZIP_MAX32 || e->clen >= KMSZIP_MAX32))
+    {
+    kmslog_error ("Can't add %s to archive: too large", e->name);
+    self->failed = TRUE;
+    errno = EFBIG;
+    return FALSE;
+    }
+
+  if (self->known)
+    {
+    self->known = FALSE;
+    if (e->len == self->known_len && e->crc == self->known_crc)
+      return TRUE;
+    kmslog_error ("Can't add %s to archive: it changed as it was added", 
+      e->name);
+    self->failed = TRUE;
+    errno = EIO;
+    return FALSE;
+    }
+
+  if (e->flags & KMSZIP_FLAG_DESC)
+    {
+    // Sizes are 64 bits if, and only if, the local header has a ZIP64
+    //  extra field 
+    unsigned char d[24], *q = d;
+    q = kmszip_put32 (q, KMSZIP_DESC_SIG);
+    q = kmszip_put32 (q, e->crc);
+    if (e->zip64)
+      {
+      q = kmszip_put64 (q, e->clen);
+      q = kmszip_put64 (q, e->len);
+      }
+    else
+      {
+      q = kmszip_put32 (q, e->clen);
+      q = kmszip_put32 (q, e->len);
+      }
+    return kmszip_write (self, d, q - d);
+    }
+
+  unsigned char *h = malloc (KMSZIP_LOCAL_MAX + strlen (e->name));
+  size_t n = kmszip_local_header (self, e, h);
+  if (fseeko (self->f, self->base + e->offset, SEEK_SET) != 0 
+       || fwrite (h, 1, n, self->f) != n
+       || fseeko (self->f, self->base + self->offset, SEEK_SET) != 0)
+    self->failed = TRUE;
+  free (h);
+  return !self->failed;
+  }
+
+
+/*==========================================================================
+kmszip_flush
+Push everything written so far out to the file, so that a reader at the
+other end of a pipe can start on it
+*==========================================================================*/
+BOOL kmszip_flush (KMSZip *self)
+  {
+  if (!self->failed && fflush (self->f) != 0)
+    self->failed = TRUE;
+  return !self->failed;
+  }
+
+
+/*==========================================================================
+kmszip_central_header
+Write the central directory header for an entry. Sizes and offsets that
+don't fit in 32 bits go in a ZIP64 extra field.
+*==========================================================================*/
+static void kmszip_central_header (KMSZip *self, const KMSZipEntry *e)
+  {
+  size_t name_len = strlen (e->name);
+  unsigned char h[46 + 28], *q = h;
+  unsigned char extra[28], *x = extra + 4;
+  if (e->len >= KMSZIP_MAX32) x = kmszip_put64 (x, e->len);
+  if (e->clen >= KMSZIP_MAX32) x = kmszip_put64 (x, e->clen);
+  if (e->offset >= KMSZIP_MAX32) x = kmszip_put64 (x, e->offset);
+  size_t extra_len = x - extra;
+  if (extra_len > 4)
+    {
+    kmszip_put16 (extra, KMSZIP_ZIP64_ID);
+    kmszip_put16 (extra + 2, extra_len - 4);
+    }
+  else
+    extra_len = 0;
+
+  q = kmszip_put32 (q, KMSZIP_CENTRAL_SIG);
+  q = kmszip_put16 (q, KMSZIP_MADE_BY);
+  q = kmszip_put16 (q, extra_len || e->zip64 ? 
+    KMSZIP_VERSION64 : KMSZIP_VERSION);
+  q = kmszip_put16 (q, e->flags);
+  q = kmszip_put16 (q, e->method);
+  q = kmszip_put16 (q, self->dos_time);
+  q = kmszip_put16 (q, self->dos_date);
+  q = kmszip_put32 (q, e->crc);
+  q = kmszip_put32 (q, kmszip_clamp32 (e->clen));
+  q = kmszip_put32 (q, kmszip_clamp32 (e->len));
+  q = kmszip_put16 (q, name_len);
+  q = kmszip_put16 (q, extra_len);
+  q = kmszip_put16 (q, 0);                // Comment length
+  q = kmszip_put16 (q, 0);                // Disk number
+  q = kmszip_put16 (q, 0);                // Internal attributes
+  q = kmszip_put32 (q, 0100644u << 16);   // External: Unix mode 
+  q = kmszip_put32 (q, kmszip_clamp32 (e->offset));
+  kmszip_write (self, h, q - h);
+  kmszip_write (self, e->name, name_len);
+  kmszip_write (self, extra, extra_len);
+  }
+
+
+/*==========================================================================
+kmszip_end_records
+Write the end of central directory record and, if the archive is too
+large or has too many entries for it, the ZIP64 records that precede it
+*==========================================================================*/
+static void kmszip_end_records (KMSZip *self, uint64_t start, 
+    uint64_t size)
+  {
+  unsigned char h[56 + 20 + 22], *q = h;
+  if (self->n >= KMSZIP_MAX16 || start >= KMSZIP_MAX32 
+       || size >= KMSZIP_MAX32)
+    {
+    uint64_t end64 = self->offset;
+    q = kmszip_put32 (q, KMSZIP_END64_SIG);
+    q = kmszip_put64 (q, 44);             // Size of the rest of this
+    q = kmszip_put16 (q, KMSZIP_MADE_BY);
+    q = kmszip_put16 (q, KMSZIP_VERSION64);
+    q = kmszip_put32 (q, 0);              // This disk
+    q = kmszip_put32 (q, 0);              // Disk with the directory
+    q = kmszip_put64 (q, self->n);
+    q = kmszip_put64 (q, self->n);
+    q = kmszip_put64 (q, size);
+    q = kmszip_put64 (q, start);
+
+    q = kmszip_put32 (q, KMSZIP_LOC64_SIG);
+    q = kmszip_put32 (q, 0);              // Disk with the ZIP64 record
+    q = kmszip_put64 (q, end64);
+    q = kmszip_put32 (q, 1);              // Number of disks
+    }
+
+  uint16_t n = self->n >= KMSZIP_MAX16 ? KMSZIP_MAX16 : self->n;
+  q = kmszip_put32 (q, KMSZIP_END_SIG);
+  q = kmszip_put16 (q, 0);                // This disk
+  q = kmszip_put16 (q, 0);                // Disk with the directory
+  q = kmszip_put16 (q, n);
+  q = kmszip_put16 (q, n);
+  q = kmszip_put32 (q, kmszip_clamp32 (size));
+  q = kmszip_put32 (q, kmszip_clamp32 (start));
+  q = kmszip_put16 (q, 0);                // Comment length
+  kmszip_write (self, h, q - h);
+  }
+
+
+/*==========================================================================
+kmszip_close
+Write the central directory, close the file, and free self. Returns
+FALSE if anything went wrong with the archive, at any stage. 
+*==========================================================================*/
+BOOL kmszip_close (KMSZip *self)
+  {
+  if (self->open)
+    kmszip_entry_end (self);
+  uint64_t start = self->offset;
+  int i;
+  for (i = 0; i < self->n; i++)
+    {
+    kmszip_central_header (self, &self->entries[i]);
+    free (self->entries[i].name);
+    }
+  kmszip_end_records (self, start, self->offset - start);
+
+  BOOL ret = !self->failed;
+  int err = errno;
+  if (fclose (self->f) != 0 && ret)
+    {
+    ret = FALSE;
+    err = errno;
+    }
+  free (self->entries);
+  free (self);
+  errno = err;
+  return ret;
+  }
+
@@ -0,0 +1,84 @@
+/*==========================================================================
+txt2epub
+kmszip.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "kmsconstants.h"
+
+// A KMSZip writes a ZIP archive, one entry at a time, in the order the 
+//  entries are added. An entry can be added from uncompressed data, 
+//  which is deflated (or stored, at level 0) as it is added, or from 
+//  data that has already been deflated by kmszip_deflate, perhaps on 
+//  another thread. An entry can also be written a piece at a time, 
+//  between kmszip_entry_begin and kmszip_entry_end, in which case it 
+//  never has to be in memory all at once. ZIP64 headers are used 
+//  where sizes, offsets, or the number of entries need them. The 
+//  archive need not be seekable, so it can be written to a pipe.
+//
+// For delta transfer, kmszip_set_rsyncable has deflate start again at
+//  places that depend only on the nearby text, so that a small change
+//  to an entry changes only a little of the archive; kmszip_set_time 
+//  gives every entry the same fixed time.
+//
+// Functions that write return FALSE, with errno set, if writing 
+//  fails, or if deflate does. Once anything has failed, kmszip_close 
+//  will also return FALSE. The functions that only deflate return NULL
+//  if deflate fails.
+
+// Compression levels are zlib's, from 0 (store) to 9, or -1 for zlib's
+//  default; or KMSZIP_MAX, which tries level 9 with the most memory, 
+//  with more than one zlib strategy, and the default level, keeping 
+//  the best. An entry written a piece at a time gets level 9 only, and
+//  on output that can't seek, is deflated even at level 0, unless it
+//  is begun with kmszip_entry_begin_stored, with its size and CRC.
+#define KMSZIP_MAX 10
+
+struct _KMSZip;
+typedef struct _KMSZip KMSZip;
+
+#ifdef __cplusplus 
+extern "C" {
+#endif
+
+KMSZip       *kmszip_create (const char *filename);
+KMSZip       *kmszip_create_file (FILE *f);
+BOOL         kmszip_add (KMSZip *self, const char *name, const void *data, 
+                size_t len, int level);
+BOOL         kmszip_add_stored (KMSZip *self, const char *name, 
+                const void *data, size_t len, uint32_t crc);
+BOOL         kmszip_add_deflated (KMSZip *self, const char *name, 
+                const void *deflated, size_t clen, size_t len, 
+                uint32_t crc);
+BOOL         kmszip_entry_begin (KMSZip *self, const char *name, 
+                int level, BOOL large);
+BOOL         kmszip_entry_begin_stored (KMSZip *self, const char *name,
+                uint64_t len, uint32_t crc);
+BOOL         kmszip_entry_write (KMSZip *self, const void *data, 
+                size_t len);
+BOOL         kmszip_entry_end (KMSZip *self);
+BOOL         kmszip_flush (KMSZip *self);
+void         kmszip_set_time (KMSZip *self, time_t t);
+void         kmszip_set_rsyncable (KMSZip *self, size_t max);
+BOOL         kmszip_close (KMSZip *self);
+uint32_t     kmszip_crc (const void *data, size_t len);
+uint32_t     kmszip_entry_crc (const KMSZip *self);
+void         *kmszip_deflate (const void *data, size_t len, int level, 
+                size_t *clen);
+void         *kmszip_deflate_blocks (const void *data, size_t len, 
+                int level, size_t block, int jobs, size_t *clen, 
+                uint32_t *crc);
+void         *kmszip_deflate_rsyncable (const void *data, size_t len, 
+                int level, size_t max, int jobs, size_t *clen, 
+                uint32_t *crc);
+
+#ifdef __cplusplus 
+}
+#endif
+
@@ -14,97 +14,373 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
-#include <pcre.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <zlib.h>
 #include "kmsconstants.h" 
 #include "kmslogging.h" 
 #include "kmsstring.h" 
 #include "kmslist.h" 
+#include "kmsinput.h" 
+#include "kmsdir.h" 
+#include "kmsparallel.h" 
+#include "kmscrc.h" 
+#include "kmshash.h" 
+#include "kmszip.h" 
+#include "cache.h" 
+#include "pipeline.h" 
 #include "epub.h" 
 #include "text.h" 
 
+// Each job is a formatting thread and a compressing thread, with room
+//  in the pipeline for chapters of its own, so beyond this many jobs
+//  for each CPU, more only use memory
+#define MAX_JOBS_PER_CPU 4
+
 
 /*==========================================================================
-  string_to_file 
+  media_level 
+  The compression level for an entry, given the level asked for. Images
+  are compressed already, and deflating them again would only waste 
+  time, so they are always stored.
 ==========================================================================*/
-static int string_to_file (const char *str, const char *file)
+static int media_level (const char *name, int level)
   {
-  int ret = 0;
-  int f = open (file, O_WRONLY | O_CREAT | O_TRUNC, 0755);
-  if (f >= 0)
+  static const char *stored[] = { ".jpg", ".jpeg", ".png", ".gif", 
+    ".webp", NULL };
+  const char *ext = strrchr (name, '.');
+  int i;
+  if (ext)
+    for (i = 0; stored[i]; i++)
+      if (strcasecmp (ext, stored[i]) == 0) return 0;
+  return level;
+  }
+
+
+/*==========================================================================
+  compression_level 
+  The compression level for a --compression mode, or -2 if there is no
+  such mode
+==========================================================================*/
+static int compression_level (const char *mode)
+  {
+  if (strcmp (mode, "store") == 0) return 0;
+  if (strcmp (mode, "fast") == 0) return 1;
+  if (strcmp (mode, "default") == 0) return Z_DEFAULT_COMPRESSION;
+  if (strcmp (mode, "max") == 0) return KMSZIP_MAX;
+  return -2;
+  }
+
+
+/*==========================================================================
+  file_crc 
+  Read a file to the end, for its size and CRC, and go back to the start.
+  Returns FALSE if it can't be read.
+==========================================================================*/
+static BOOL file_crc (int f, uint64_t *len, uint32_t *crc)
+  {
+  char buff[65536];
+  *len = 0;
+  *crc = 0;
+  while (TRUE)
     {
-    write (f, str, strlen (str));
-    close (f);
+    ssize_t n = read (f, buff, sizeof (buff));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return FALSE;
+    if (n == 0) break;
+    *crc = kmscrc_update (*crc, buff, n);
+    *len += n;
     }
-  else 
+  return lseek (f, 0, SEEK_SET) == 0;
+  }
+
+
+/*==========================================================================
+  file_to_zip 
+  Add the contents of a file to the archive, under the given name. The
+  file is copied a buffer at a time, so it need not fit in memory. A 
+  file that is to be stored is read once first, for its size and CRC, 
+  so that it can be stored even if the archive can't seek. Returns 
+  FALSE if the file can't be read, or the archive written; either way, 
+  the archive is still usable, if the error can be tolerated.
+==========================================================================*/
+static BOOL file_to_zip (KMSZip *zip, const char *name, const char *file,
+    int level)
+  {
+  int f = open (file, O_RDONLY);
+  if (f < 0) return FALSE;
+  level = media_level (name, level);
+  uint64_t len;
+  uint32_t crc;
+  BOOL ret;
+  // A pipe can only be read once, so it can't be stored
+  if (level == 0 && lseek (f, 0, SEEK_CUR) == 0)
+    ret = file_crc (f, &len, &crc) 
+      && kmszip_entry_begin_stored (zip, name, len, crc);
+  else
+    ret = kmszip_entry_begin (zip, name, level, FALSE);
+  char buff[65536];
+  while (ret)
     {
-    ret = errno;
-    printf ("%s\n", strerror (errno));
+    ssize_t n = read (f, buff, sizeof (buff));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) ret = FALSE;
+    if (n <= 0) break;
+    ret = kmszip_entry_write (zip, buff, n);
     }
+  if (!kmszip_entry_end (zip)) 
+    ret = FALSE;
+  close (f);
   return ret;
   }
 
 
 /*==========================================================================
-file_get_first_line
-Read the first line in a file. Returns NULL if the file cannot be read
+add_input
+Add a file named on the command line to the list of input files, or
+every file in it, in natural order, if it is a directory
 ==========================================================================*/
-static char *file_get_first_line (char *filename)
+static BOOL add_input (KMSList *inputs, const char *path)
   {
-  char *ret = NULL;
-  FILE *f = fopen (filename, "r");
-  if (f)
+  if (strcmp (path, "-") != 0 && kmsdir_is_dir (path))
     {
-    char *line;
-    size_t n = 0;
-    if (getline (&line, &n, f) > 0) 
-      ret = line;
-    fclose (f);
+    if (kmsdir_list_files (path, inputs)) return TRUE;
+    kmslog_error ("Can't read directory %s: %s", path, strerror (errno));
+    return FALSE;
     }
-  return ret;
+  kmslist_append_unlocked (inputs, strdup (path));
+  return TRUE;
   }
- 
+
+
+/*==========================================================================
+read_input_list
+Add the files named in list_file, one per line, to the list of input
+files. Blank lines are ignored; "-" means stdin. The names are taken as 
+they are, without checking for directories, so that a list of a hundred
+thousand files doesn't need a hundred thousand stat() calls.
+==========================================================================*/
+static BOOL read_input_list (KMSList *inputs, const char *list_file)
+  {
+  KMSInput *input = kmsinput_open (list_file);
+  if (!input)
+    {
+    kmslog_error ("Can't read input list %s: %s", list_file, 
+      strerror (errno));
+    return FALSE;
+    }
+  KMSInputLine line;
+  while (kmsinput_next_text_line (input, &line))
+    {
+    if (line.len > 0)
+      kmslist_append_unlocked (inputs, strndup (line.text.str, line.len));
+    }
+  kmsinput_close (input);
+  return TRUE;
+  }
+
 
 /*==========================================================================
 make_chapter_list
-Use the filenames as a list of chapter names
+Use the filenames as a list of chapter names. With --first-lines, these
+are only for chapters that turn out to have no first line.
 ==========================================================================*/
-static KMSList *make_chapter_list (char **argv, int argc, int offset, 
-    BOOL firstlines)
+static KMSList *make_chapter_list (char **files, int count)
   {
   KMSList *ch_list = kmslist_create_strings();
 
-  if (firstlines)
+  int i;
+  for (i = 0; i < count; i++)
     {
-    int i;
-    for (i = offset; i < argc; i++)
-      {
-      char *ch = file_get_first_line (argv[i]); 
-      if (!ch)
-        {
-        char *filename = basename (argv[i]);
-        ch = strdup (filename);
-        char *p = strrchr (ch, '.');
-        if (p) *p = 0;
-        }
-      kmslist_append (ch_list, ch); 
-      }
+    char *filename = basename (files[i]);
+    char *ch = strdup (filename);
+    char *p = strrchr (ch, '.');
+    if (p) *p = 0;
+    kmslist_append_unlocked (ch_list, ch); 
     }
-  else
+
+  return ch_list;
+  }
+
+
+/*==========================================================================
+use_first_lines
+Make the list of chapter names for the table of contents, once the 
+chapters are converted: each one's first line, if it has one, or else
+its name from ch_list. Takes the first lines, and frees the array.
+==========================================================================*/
+static KMSList *use_first_lines (KMSList *ch_list, char **first_lines, 
+    int count)
+  {
+  KMSList *toc_list = kmslist_create_strings();
+  int i;
+  for (i = 0; i < count; i++)
     {
-    int i;
-    for (i = offset; i < argc; i++)
-      {
-      char *filename = basename (argv[i]);
-      char *ch = strdup (filename);
-      char *p = strrchr (ch, '.');
-      if (p) *p = 0;
-      kmslist_append (ch_list, ch); 
-      }
+    char *ch = first_lines[i];
+    if (!ch) ch = strdup (kmslist_get_unlocked (ch_list, i));
+    kmslist_append_unlocked (toc_list, ch); 
     }
+  free (first_lines);
+  return toc_list;
+  }
 
-  return ch_list;
+
+/*==========================================================================
+add_content_opf
+==========================================================================*/
+static void add_content_opf (KMSZip *zip, int file_count, 
+    const char *book_title, const char *book_author, 
+    const char *book_language, const char *cover_basename, long pid, 
+    long tim, int level)
+  {
+  char *content_opf = epub_make_content_opf (file_count, book_title,
+    book_author, book_language, cover_basename, pid, tim); 
+  kmszip_add (zip, "content.opf", content_opf, strlen (content_opf),
+    level);
+  free (content_opf);
+  }
+
+
+/*==========================================================================
+add_toc_ncx
+==========================================================================*/
+static void add_toc_ncx (KMSZip *zip, KMSList *ch_list, 
+    const char *book_title, long pid, long tim, int level)
+  {
+  char *tocncx_ncx = epub_make_toc_ncx (ch_list, book_title, pid, tim); 
+  kmszip_add (zip, "toc.ncx", tocncx_ncx, strlen (tocncx_ncx), level);
+  free (tocncx_ncx);
+  }
+
+
+/*==========================================================================
+  format_settings 
+  A description of every setting that affects how chapters are 
+  formatted, including the verbatim marker, which is not part of the 
+  book. The caller must free it.
+==========================================================================*/
+static char *format_settings (const PipelineBook *book, 
+    const char *verbatim_marker)
+  {
+  char *format = NULL;
+  asprintf (&format, "indent_is_para=%d markdown=%d first_is_title=%d "
+    "line_paras=%d remove_pagenum=%d para_indent=%d verbatim_marker=%s", 
+    book->indent_is_para, book->markdown, book->first_is_title, 
+    book->line_paras, book->remove_pagenum, book->para_indent, 
+    verbatim_marker);
+  return format;
+  }
+
+
+/*==========================================================================
+  open_cache 
+  Open the cache in the usual place, describing to it every setting that
+  affects how chapters are formatted, and how they are compressed. 
+  Returns NULL if there is no usable cache. 
+==========================================================================*/
+static Cache *open_cache (const PipelineBook *book, 
+    const char *verbatim_marker)
+  {
+  char *dir = cache_default_dir ();
+  if (!dir)
+    {
+    kmslog_warning ("Can't find a directory for the cache");
+    return NULL;
+    }
+  char *format = format_settings (book, verbatim_marker);
+  char *compression = NULL;
+  asprintf (&compression, "level=%d block_size=%zu rsyncable=%d", 
+    book->level, book->block_size, book->rsyncable);
+  Cache *cache = cache_open (dir, format, compression);
+  free (format);
+  free (compression);
+  free (dir);
+  return cache;
+  }
+
+
+/*==========================================================================
+  stable_id 
+  Numbers to make the book's identifier from, in place of the process ID
+  and the time, that depend only on the title and author, so that the
+  same book gets the same identifier whenever it is made 
+==========================================================================*/
+static void stable_id (const char *title, const char *author, long *pid, 
+    long *tim)
+  {
+  if (!author) author = "unknown";
+  uint32_t crc = kmscrc_update (0, title, strlen (title));
+  *pid = crc;
+  *tim = kmscrc_update (crc, author, strlen (author));
+  }
+
+
+/*==========================================================================
+  hash_crc 
+  Carry on hash h with a CRC-32, a byte at a time, so that the hash is 
+  the same on any machine
+==========================================================================*/
+static uint64_t hash_crc (uint32_t crc, uint64_t h)
+  {
+  unsigned char b[4] = { crc, crc >> 8, crc >> 16, crc >> 24 };
+  return kmshash64 (b, sizeof (b), h);
+  }
+
+
+/*==========================================================================
+  content_id 
+  Numbers to make the book's identifier from, in place of the process ID
+  and the time, that depend on nothing but what goes into the book: its
+  metadata, the settings, and the name and contents of every chapter, 
+  and of the cover. The contents are represented by the CRC-32s of the 
+  entries they were written to, so nothing has to be read again, and 
+  text from stdin counts as much as text from a file. cover_name is 
+  NULL if there is no cover, and cover_crc is only used if cover_read.
+==========================================================================*/
+static void content_id (const PipelineBook *book, const char *settings,
+    const char *title, const char *author, const char *language, 
+    const char *cover_name, BOOL cover_read, uint32_t cover_crc, 
+    long *pid, long *tim)
+  {
+  uint64_t h = kmshash64_str (settings, 0);
+  h = kmshash64_str (title, h);
+  h = kmshash64_str (author ? author : "", h);
+  h = kmshash64_str (language ? language : "", h);
+  int i;
+  for (i = 0; i < book->count; i++)
+    {
+    h = kmshash64_str (kmslist_get_unlocked (book->titles, i), h);
+    h = hash_crc (book->crcs[i], h);
+    }
+  if (cover_name)
+    {
+    h = kmshash64_str (cover_name, h);
+    if (cover_read)
+      h = hash_crc (cover_crc, h);
+    }
+  *pid = (long)(h >> 32);
+  *tim = (long)(h & 0xFFFFFFFF);
+  }
+
+
+/*==========================================================================
+  fixed_time 
+  The time to give every entry, when the output must not depend on when
+  it was made: SOURCE_DATE_EPOCH, as reproducible builds use, or 
+  failing that, the earliest time a ZIP can hold
+==========================================================================*/
+static time_t fixed_time (void)
+  {
+  const char *epoch = getenv ("SOURCE_DATE_EPOCH");
+  if (!epoch || !*epoch) return 0;
+  char *end;
+  long long t = strtoll (epoch, &end, 10);
+  if (*end || t < 0)
+    {
+    kmslog_warning ("Ignoring invalid SOURCE_DATE_EPOCH: %s", epoch);
+    return 0;
+    }
+  return (time_t)t;
   }
 
 
@@ -120,12 +396,21 @@ int main (int argc, char **argv)
   static BOOL para_indent = FALSE;
   static BOOL remove_pagenum = FALSE;
   static int loglevel = ERROR;
+  int jobs = 1;
+  // Chapters bigger than this are deflated in blocks, in kB 
+  long block_kb = 1024;
+  int level = Z_DEFAULT_COMPRESSION;
+  static BOOL stream = FALSE;
+  static BOOL rsyncable = FALSE;
+  static BOOL reproducible = FALSE;
+  static BOOL use_cache = FALSE;
   char *epub_file = NULL;
   char *book_title = NULL;
   char *book_author = NULL;
   char *book_language = NULL;
   char *cover_image = NULL;
   char *cover_basename = NULL; 
+  char *input_list = NULL;
   char *verbatim_marker = strdup ("`"); 
 
   static struct option long_options[] = 
@@ -139,7 +424,15 @@ int main (int argc, char **argv)
      {"output-file", required_argument, NULL, 'o'},
      {"ignore-indent", no_argument, NULL, 'i'},
      {"ignore-markdown", no_argument, NULL, 'm'},
+     {"input-list", required_argument, NULL, 0},
+     {"jobs", required_argument, NULL, 'j'},
+     {"block-size", required_argument, NULL, 0},
+     {"cache", no_argument, NULL, 0},
+     {"compression", required_argument, NULL, 0},
      {"remove-pagenum", required_argument, NULL, 'r'},
+     {"reproducible", no_argument, NULL, 0},
+     {"rsyncable", no_argument, NULL, 0},
+     {"stream", no_argument, NULL, 0},
      {"title", required_argument, NULL, 't'},
      {"verbatim-marker", required_argument, NULL, 'm'},
      {"extra-para", no_argument, NULL, 'x'},
@@ -154,7 +447,7 @@ int main (int argc, char **argv)
   while (1)
    {
    int option_index = 0;
-   opt = getopt_long (argc, argv, "vhp?o:t:a:l:ic:fxrm:",
+   opt = getopt_long (argc, argv, "vhp?o:t:a:l:ic:fxrm:j:",
      long_options, &option_index);
 
    if (opt == -1) break;
@@ -191,6 +484,29 @@ int main (int argc, char **argv)
           extra_para = TRUE; 
         else if (strcmp (long_options[option_index].name, "para-indent") == 0)
           para_indent = TRUE; 
+        else if (strcmp (long_options[option_index].name, "stream") == 0)
+          stream = TRUE; 
+        else if (strcmp (long_options[option_index].name, "rsyncable") == 0)
+          rsyncable = TRUE; 
+        else if (strcmp (long_options[option_index].name, "cache") == 0)
+          use_cache = TRUE; 
+        else if (strcmp (long_options[option_index].name, "reproducible") 
+               == 0)
+          reproducible = TRUE; 
+        else if (strcmp (long_options[option_index].name, "input-list") == 0)
+          input_list = strdup (optarg); 
+        else if (strcmp (long_options[option_index].name, "block-size") == 0)
+          block_kb = atol (optarg); 
+        else if (strcmp (long_options[option_index].name, "compression") 
+               == 0)
+          {
+          level = compression_level (optarg);
+          if (level == -2)
+            {
+            kmslog_error ("Compression must be store, fast, default, or max");
+            exit (-1);
+            }
+          }
         else if (strcmp (long_options[option_index].name, "ignore-markdown") 
                == 0)
           markdown = FALSE; 
@@ -203,6 +519,7 @@ int main (int argc, char **argv)
      case 'f': firstlines = TRUE; break;
      case 'h': case '?': show_usage = TRUE; break;
      case 'i': indent_is_para = FALSE; break;
+     case 'j': jobs = atoi (optarg); break;
      case 'l': book_language = strdup (optarg); break;
      case 'o': epub_file = strdup (optarg); break;
      case 'p': para_indent = TRUE; break;
@@ -220,17 +537,27 @@ int main (int argc, char **argv)
     {
     printf ("Usage %s [options]\n", argv[0]);
     printf ("  -a,--author A         set book author (default: unknown)\n");
+    printf ("     --block-size N     deflate big chapters in N kB blocks,\n");
+    printf ("                          in parallel; 0 for none (default: 1024)\n");
+    printf ("     --cache            reuse chapters converted before\n");
     printf ("  -c,--cover-image F    use image file F as the cover\n");
+    printf ("     --compression M    store, fast, default, or max\n");
     printf ("     --loglevel N       log verbosity, 0 (default) - 3\n");
     printf ("     --ignore-indent    don't break paragraph on indent\n");
     printf ("     --ignore-markdown  do not respect Markdown formatting\n");
+    printf ("     --input-list F     read input filenames from F, one per line\n");
     printf ("  -f,--first-lines      first line is chapter heading\n");
+    printf ("  -j,--jobs N           convert N chapters at a time;\n");
+    printf ("                          0 means one per CPU (default: 1)\n");
     printf ("  -?, -h                show this message\n");
     printf ("  -l,--language A       set book language (default: en)\n");
     printf ("  -r,--remove-pagenum   try to remove page numbers\n");
+    printf ("     --reproducible     make the same EPUB from the same input\n");
+    printf ("     --rsyncable        make the EPUB cheap to update by rsync\n");
+    printf ("     --stream           convert in small pieces, to save memory\n");
     printf ("  -t,--title A          set book title (default: filename)\n");
     printf ("  -v,--version          show version information\n");
-    printf ("  -o,--output-file      EPUB output filename\n");
+    printf ("  -o,--output-file      EPUB output filename; - for stdout\n");
     printf ("  -p,--para-indent      Paragraph indent replaces blank line\n");
     printf ("  -x,--extra-para       Every input line is a paragraph\n");
     exit (0);
@@ -247,9 +574,54 @@ int main (int argc, char **argv)
   int ret = 0;
   kmslogging_set_level (loglevel); 
 
+  // "-o -" means write the EPUB to stdout, so messages must go elsewhere
+  BOOL to_stdout = epub_file && strcmp (epub_file, "-") == 0;
+  if (to_stdout)
+    {
+    kmslogging_set_log_stderr (TRUE);
+    if (isatty (STDOUT_FILENO))
+      {
+      kmslog_error ("Won't write an EPUB to a terminal");
+      ret = -1;
+      }
+    }
+
+  if (jobs <= 0)
+    jobs = kmsparallel_cpus ();
+  if (jobs > MAX_JOBS_PER_CPU * kmsparallel_cpus ())
+    {
+    kmslog_warning ("Too many jobs; using %d", 
+      MAX_JOBS_PER_CPU * kmsparallel_cpus ());
+    jobs = MAX_JOBS_PER_CPU * kmsparallel_cpus ();
+    }
 
-  int file_count = argc - optind; 
-  if (file_count > 0)
+  if (block_kb < 0 || block_kb >= 1024 * 1024)
+    {
+    kmslog_error ("Block size must be at least 0, and less than 1Gb");
+    ret = -1;
+    }
+
+
+  // The input files are those in the input list, if there is one, then
+  //  those on the command line, with each directory replaced by the
+  //  files in it
+  KMSList *inputs = kmslist_create_strings ();
+  if (ret == 0 && input_list && !read_input_list (inputs, input_list))
+    ret = -1;
+  int i;
+  for (i = optind; i < argc && ret == 0; i++)
+    if (!add_input (inputs, argv[i])) ret = -1;
+
+  int file_count = kmslist_length_unlocked (inputs); 
+  char **files = malloc ((file_count + 1) * sizeof (char *));
+  for (i = 0; i < file_count; i++)
+    files[i] = kmslist_get_unlocked (inputs, i);
+
+  if (ret != 0)
+    {
+    // Already failed
+    }
+  else if (file_count > 0)
     {
     if (epub_file)
       {
@@ -257,9 +629,17 @@ int main (int argc, char **argv)
       } 
     else
       {
-      if (file_count == 1)
+      // A single directory is named like a single file
+      if (!input_list && argc - optind == 1 && kmsdir_is_dir (argv[optind]))
+        {
+        // realpath() turns "." or "book/" into something with a name
+        char *dir = realpath (argv [optind], NULL);
+        asprintf (&epub_file, "%s.epub", dir);
+        free (dir);
+        }
+      else if (file_count == 1)
 	{
-        const char *input_file = argv [optind];
+        const char *input_file = files[0];
 	if (strcmp (input_file, "-") == 0)
 	  {
 	  // Need to specify an output filename with input stdin
@@ -297,14 +677,24 @@ int main (int argc, char **argv)
   if (ret == 0)
     {
     text_init_regex (verbatim_marker);
+    kmscrc_init ();
 
     // At this point the output filename is known, so we can use it as
-    //   the book title, unless a title is specified
+    //   the book title, unless a title is specified. If the output is
+    //   stdout, the first input filename will have to do
 
     if (book_title)
       {
       // Do nothing -- we already know it
       }
+    else if (to_stdout)
+      {
+      book_title = strdup (basename (files[0]));
+      char *p = strrchr (book_title, '.');
+      if (p) *p = 0;
+      kmslog_debug ("Book title \"%s\" derived from input filename", 
+       book_title);
+      }
     else
       {
       book_title = strdup (basename (epub_file));
@@ -314,162 +704,132 @@ int main (int argc, char **argv)
        book_title);
       }
 
-    int pid = getpid();
-
-    char *working_dir;
-    asprintf (&working_dir, "/tmp/txt2epub%d",pid); 
+    long pid = (long)getpid();
+    long tim = (long)time (NULL);
+    if (rsyncable)
+      stable_id (book_title, book_author, &pid, &tim);
 
-    kmslog_debug ("Working directory is %s", working_dir);
-    if (mkdir (working_dir, 0755) == 0)
+    kmslog_debug ("Creating zipfile %s", epub_file);
+    KMSZip *zip = to_stdout ? kmszip_create_file (stdout) 
+      : kmszip_create (epub_file);
+    if (zip)
       {
-      char *meta_inf;
-      asprintf (&meta_inf, "%s/META-INF", working_dir);
-      mkdir (meta_inf, 0755);
+      if (rsyncable || reproducible)
+        kmszip_set_time (zip, fixed_time ());
+      if (rsyncable)
+        kmszip_set_rsyncable (zip, (size_t)block_kb * 1024);
+
+      // To satisfy fussy checkers, the mimetype file must be first in 
+      //   the archive, and uncompressed
+      const char *mimetype = "application/epub+zip";
+      kmszip_add (zip, "mimetype", mimetype, strlen (mimetype), 0);
 
-      char *container;
-      asprintf (&container, "%s/container.xml", meta_inf);
       char *container_xml = epub_make_container_xml();
-      char *cmd;
-      ret = string_to_file (container_xml, container);
+      kmszip_add (zip, "META-INF/container.xml", container_xml, 
+        strlen (container_xml), level);
+      free (container_xml);
+      // If the output is a pipe, the reader can start now
+      kmszip_flush (zip);
 
       // Copy the cover image, if there is one
+      BOOL cover_read = FALSE;
+      uint32_t cover_crc = 0;
       if (cover_image)
         {
-        if (access (cover_image, R_OK) == 0)
-          {
-          char *cmd;
-          asprintf (&cmd, "cp \"%s\" \"%s\"", cover_image, working_dir);
-          system (cmd);
-          free (cmd);
-          }
+        cover_basename = basename (cover_image);
+        cover_read = file_to_zip (zip, cover_basename, cover_image, level);
+        if (cover_read)
+          cover_crc = kmszip_entry_crc (zip);
         else
-          {
           kmslog_error ("Can't read cover image file: %s", cover_image);
-          }
-        cover_basename = basename (cover_image);
         }
- 
-      if (ret == 0)
-	{
-        // This sucks. We need the absolute pathname of the epub file
-        //   because the zip utilituy reqires that we cd to the temp dir;
-        //   but the epub file does not yet exist. So we have to create it
-        //   so that realpath will work. And then we have to delete it again,
-        //   else zip -r will fail, because it isn't a proper zipfile. Ugh.
-        int f = open (epub_file, O_WRONLY | O_CREAT | O_TRUNC, 
-          S_IRUSR | S_IWUSR);
-        if (f > 0)
-          {
-	  close (f);
-	  char epub_path[PATH_MAX];
-	  realpath (epub_file, epub_path); 
-	  unlink (epub_path);
-	  char *content;
-          long pid = (long)getpid();
-          long tim = (long)time (NULL);
-	  asprintf (&content, "%s/content.opf", working_dir);
-	  char *content_opf = epub_make_content_opf (file_count, book_title,
-            book_author, book_language, cover_basename, pid, tim); 
-	  ret = string_to_file (content_opf, content);
-	  if (ret == 0)
-	    { 
-	    char *mimetype;
-	    asprintf (&mimetype, "%s/mimetype", working_dir);
-	    string_to_file ("application/epub+zip", mimetype);
-	    free (mimetype);
- 
-            KMSList *chapter_list = make_chapter_list (argv, argc, optind, 
-              firstlines); 
-	     
-	    char *tocncx;
-	    char *tocncx_ncx = epub_make_toc_ncx (chapter_list, book_title, 
-               pid, tim); 
-	    asprintf (&tocncx, "%s/toc.ncx", working_dir);
-	    string_to_file (tocncx_ncx, tocncx);
-	    free (tocncx);
-	    free (tocncx_ncx);
-	     
-	    char *cover;
-	    char *cover_xhtml = epub_make_cover (cover_basename); 
-	    asprintf (&cover, "%s/cover.html", working_dir);
-	    string_to_file (cover_xhtml, cover);
-	    free (cover);
-	    free (cover_xhtml);
-
-	    int i;
-	    for (i = 0; i < file_count; i++)
-	      {
-	      char *file;
-              char *title = kmslist_get (chapter_list, i);
-	      asprintf (&file, "%s/file%d.html", working_dir, i);
-	      char *file_html = input_file_to_xhtml (argv [optind+i], title,
-                indent_is_para, markdown, firstlines, extra_para, 
-                remove_pagenum, para_indent);
-	      if (string_to_file (file_html, file))
-                {
-                kmslog_error 
-                  ("Can't write file %s: %s\n", file, strerror(errno));
-                }
-	      free (file);
-	      free (file_html);
-	      }
-
-	    kmslog_debug ("Creating zipfile %s", epub_path);
-
-            // Sigh. To satisfy fussy checkers, the mimetype files must be first in the archive, and uncompressed
-
-	    asprintf (&cmd, "cd \"%s\"; zip -q -X -0 \"%s\" mimetype", 
-              working_dir, epub_path);
-	    system (cmd);
-	    free (cmd);
-
-            // So now we delete mimetype, and store everything else with default compression
-
-	    asprintf (&cmd, "cd \"%s\"; rm mimetype", 
-              working_dir);
-	    system (cmd);
-	    free (cmd);
-
-	    asprintf (&cmd, "cd \"%s\"; zip -q -r \"%s\" .", 
-              working_dir, epub_path);
-	    system (cmd);
-	    free (cmd);
-
-            kmslist_destroy (chapter_list);
-	    }
-	  free (content);
-	  free (content_opf);
-          }
-        else
-          {
-          ret = errno;
-	  kmslog_error 
-            ("Can't write output file %s: %s", epub_file, strerror (errno));
-          }
-	}
-      else
-	{
-	kmslog_error ("Can't write file %s: %s", container_xml, strerror (errno));
-	}
-      free (container_xml);
-      kmslog_debug ("Deleting temporary directory %s", working_dir);
-      asprintf (&cmd, "rm -rf \"%s\"", working_dir);
-      system (cmd);
-      free (cmd);
-      free (container);
-      free (meta_inf);
+
+      KMSList *chapter_list = make_chapter_list (files, file_count); 
+      // With --first-lines, the titles are taken from the chapters as 
+      //  they are converted, so the table of contents has to come after
+      //  them. With --reproducible, the identifier is made from the 
+      //  chapters as they are converted, so the content and the table
+      //  of contents, which both contain it, come after them 
+      char **first_lines = firstlines ? 
+        calloc (file_count, sizeof (char *)) : NULL;
+      uint32_t *crcs = reproducible ? 
+        calloc (file_count, sizeof (uint32_t)) : NULL;
+      PipelineBook book = { files, file_count, chapter_list, first_lines,
+        indent_is_para, markdown, firstlines, extra_para, 
+        remove_pagenum, para_indent, stream, (size_t)block_kb * 1024, 
+        level, rsyncable, NULL, crcs };
+
+      if (!reproducible)
+        add_content_opf (zip, file_count, book_title, book_author, 
+          book_language, cover_basename, pid, tim, level);
+      if (!first_lines && !reproducible)
+        add_toc_ncx (zip, chapter_list, book_title, pid, tim, level);
+
+      char *cover_xhtml = epub_make_cover (cover_basename); 
+      kmszip_add (zip, "cover.html", cover_xhtml, strlen (cover_xhtml),
+        level);
+      free (cover_xhtml);
+
+      if (use_cache)
+        book.cache = open_cache (&book, verbatim_marker);
+      BOOL converted = pipeline_run (&book, zip, jobs);
+      if (book.cache) cache_close (book.cache);
+      if (reproducible)
+        {
+        char *settings = format_settings (&book, verbatim_marker);
+        content_id (&book, settings, book_title, book_author, 
+          book_language, cover_basename, cover_read, cover_crc, 
+          &pid, &tim);
+        free (settings);
+        free (crcs);
+        add_content_opf (zip, file_count, book_title, book_author, 
+          book_language, cover_basename, pid, tim, level);
+        }
+      if (first_lines)
+        {
+        KMSList *toc_list = use_first_lines (chapter_list, first_lines, 
+          file_count);
+        add_toc_ncx (zip, toc_list, book_title, pid, tim, level);
+        kmslist_destroy (toc_list);
+        }
+      else if (reproducible)
+        add_toc_ncx (zip, chapter_list, book_title, pid, tim, level);
+      kmslist_destroy (chapter_list);
+
+      if (!kmszip_close (zip))
+        {
+        ret = errno;
+        kmslog_error 
+          ("Can't write output file %s: %s", epub_file, strerror (errno));
+        }
+      else if (!converted)
+        {
+        ret = -1;
+        kmslog_error ("Can't convert all the chapters of %s", epub_file);
+        }
+      if (ret != 0)
+        {
+        // An incomplete archive is no use to anybody; but the output
+        //  might be a device or a pipe, which must be left alone
+        struct stat sb;
+        if (!to_stdout && stat (epub_file, &sb) == 0 
+             && S_ISREG (sb.st_mode))
+          unlink (epub_file);
+        }
       }
     else
       {
-      kmslog_error ("Can't create temporary directory %s: %s",
-	working_dir, strerror (errno));
-      ret = errno; 
+      ret = errno;
+      kmslog_error 
+        ("Can't write output file %s: %s", epub_file, strerror (errno));
       }
 
-    free (working_dir);
     text_cleanup_regex();
     }
 
+  free (files);
+  kmslist_destroy (inputs);
+  if (input_list) free (input_list);
   if (epub_file) free (epub_file);
   if (book_title) free (book_title);
   if (book_author) free (book_author);
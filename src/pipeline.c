@@ -0,0 +1,546 @@
+/*==========================================================================
+  txt2epub
+  pipeline.c
+  Convert chapters and add them to the archive, with reading, formatting,
+  compression, and writing all going on at the same time. 
+  Copyright (c)2024 Kevin Boone, GPL3.0 
+==========================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "kmsconstants.h" 
+#include "kmslogging.h" 
+#include "kmsstring.h" 
+#include "kmslist.h" 
+#include "kmsinput.h" 
+#include "kmsqueue.h" 
+#include "kmszip.h" 
+#include "cache.h" 
+#include "text.h" 
+#include "pipeline.h" 
+
+// The stages are:
+//
+//  reader     -- one thread, opens each input file in spine order, and
+//                starts the kernel reading it 
+//  formatters -- 'jobs' threads, format chapters as XHTML, in whatever
+//                order they finish
+//  compressors -- 'jobs' threads, deflate each chapter into a buffer of
+//                its own, in whatever order they finish. A big chapter
+//                is deflated in blocks, which spare threads can share
+//  writer     -- the calling thread, adds chapters to the archive in
+//                spine order, holding back any that arrive early
+//
+// Each stage passes PipelineItems to the next on a KMSQueue, and a NULL
+//  item means there are no more. The reader may always get
+//  PIPELINE_WINDOW_PER_JOB * jobs chapters ahead of the writer, and up
+//  to PIPELINE_WINDOW_MAX_PER_JOB * jobs if they are small enough to 
+//  fit in PIPELINE_WINDOW_BYTES_PER_JOB * jobs, so that a book of 
+//  thousands of tiny chapters doesn't have every thread waking up for
+//  every one. Once the window is full, the reader waits for it to be
+//  half empty, so that it reads in batches.
+//
+// With a cache, a formatter looks for each chapter there first, and 
+//  passes on what it finds, with nothing left to do, unless it has 
+//  to be compressed again, with different settings. Whatever a 
+//  compressor does, it adds to the cache.
+//
+// A chapter that is too big to hold in memory is streamed instead: the
+//  writer reads, formats, and compresses it a piece at a time, straight
+//  into the archive, when its turn comes; the other stages just pass it
+//  on. That is any chapter whose input is PIPELINE_STREAM_MIN bytes or
+//  more, or of unknown size, like stdin; and any whose XHTML turns out
+//  to be that big, when a formatter has tried it. With book->stream set,
+//  every chapter is streamed, on the calling thread alone, so the memory
+//  used does not depend on the size of the input at all. 
+
+#define PIPELINE_WINDOW_PER_JOB 2
+#define PIPELINE_WINDOW_MAX_PER_JOB 64
+#define PIPELINE_WINDOW_BYTES_PER_JOB (8L * 1024 * 1024)
+
+// Chapters of this size or more, before or after formatting, are 
+//  always streamed 
+#define PIPELINE_STREAM_MIN (1024L * 1024 * 1024)
+
+// Formatting can, in principle, make text five times bigger, so an
+//  input of this size or more might make a ZIP entry of 4 GB or more
+#define PIPELINE_LARGE_ENTRY (800L * 1024 * 1024)
+
+typedef struct _PipelineItem
+  {
+  int index;              // Place in the spine
+  size_t size;            // Of the input, for the window
+  BOOL stream;            // Left to the writer
+  KMSInput *input;        // Set by the reader; kept if streamed, and
+                          //  it can't be opened again
+  KMSString *xhtml;       // Set by a formatter; kept if stored
+  void *deflated;         // Set by a compressor
+  size_t clen;
+  size_t len;
+  uint32_t crc;           // Set by a formatter
+  CacheKey key;           // Set by a formatter, if keyed
+  BOOL keyed;
+  BOOL cached;            // Found complete in the cache
+  BOOL failed;            // Could not be compressed
+  } PipelineItem;
+
+typedef struct _Pipeline
+  {
+  const PipelineBook *book;
+  int jobs;               // Formatter threads, and compressor threads
+  int chunk_jobs;         // Threads for each chapter, if there are few
+  KMSQueue *read_q;       // Reader to formatters
+  KMSQueue *format_q;     // Formatters to compressors
+  KMSQueue *compress_q;   // Compressors to writer
+  pthread_mutex_t window_lock;
+  pthread_cond_t window_open;
+  int window_min;         // Chapters that may always be in progress
+  int window_max;         // Chapters that may be, if they are small
+  size_t window_bytes;    // The size they must fit in
+  int in_flight;          // Chapters started, and not yet written
+  size_t in_flight_bytes;
+  int formatters_left;
+  int compressors_left;
+  } Pipeline;
+
+
+/*==========================================================================
+  pipeline_window_full
+  Whether the reader must wait before starting another chapter
+==========================================================================*/
+static BOOL pipeline_window_full (const Pipeline *p)
+  {
+  return p->in_flight >= p->window_min && (p->in_flight >= p->window_max 
+    || p->in_flight_bytes >= p->window_bytes);
+  }
+
+
+/*==========================================================================
+  pipeline_window_open 
+  Whether a reader that found the window full may go on
+==========================================================================*/
+static BOOL pipeline_window_open (const Pipeline *p)
+  {
+  return p->in_flight < p->window_min || (p->in_flight <= p->window_max / 2
+    && p->in_flight_bytes <= p->window_bytes / 2);
+  }
+
+
+/*==========================================================================
+  pipeline_reader 
+==========================================================================*/
+static void *pipeline_reader (void *arg)
+  {
+  Pipeline *p = arg;
+  int i;
+  for (i = 0; i < p->book->count; i++)
+    {
+    pthread_mutex_lock (&p->window_lock);
+    if (pipeline_window_full (p))
+      while (!pipeline_window_open (p))
+        pthread_cond_wait (&p->window_open, &p->window_lock);
+    pthread_mutex_unlock (&p->window_lock);
+
+    PipelineItem *item = calloc (1, sizeof (PipelineItem));
+    item->index = i;
+    // kmsinput_open has to find the size anyway, so there is no need
+    //  to stat() the file first
+    item->input = kmsinput_open (p->book->files[i]);
+    if (item->input && kmsinput_size (item->input) < 0)
+      item->stream = TRUE;
+    else if (item->input 
+         && kmsinput_size (item->input) >= PIPELINE_STREAM_MIN)
+      {
+      kmsinput_close (item->input);
+      item->input = NULL;
+      item->stream = TRUE;
+      }
+    else if (item->input)
+      {
+      kmsinput_prefetch (item->input);
+      item->size = kmsinput_size (item->input);
+      }
+    pthread_mutex_lock (&p->window_lock);
+    p->in_flight++;
+    p->in_flight_bytes += item->size;
+    pthread_mutex_unlock (&p->window_lock);
+    kmsqueue_push (p->read_q, item);
+    }
+  for (i = 0; i < p->jobs; i++)
+    kmsqueue_push (p->read_q, NULL);
+  return NULL;
+  }
+
+
+/*==========================================================================
+  pipeline_title 
+  The title of chapter i. With first_lines, that is the first line of 
+  the input, which is kept there for the table of contents, so that
+  the file doesn't have to be read again for it. A chapter that turns 
+  out to need streaming gets here twice. Each chapter is only ever 
+  handled by one thread at a time, so no lock is needed.
+==========================================================================*/
+static const char *pipeline_title (const PipelineBook *b, int i, 
+    KMSInput *input)
+  {
+  if (b->first_lines && input)
+    {
+    free (b->first_lines[i]);
+    b->first_lines[i] = kmsinput_peek_text_line (input);
+    }
+  if (b->first_lines && b->first_lines[i])
+    return b->first_lines[i];
+  return kmslist_get_unlocked (b->titles, i);
+  }
+
+
+/*==========================================================================
+  pipeline_from_cache 
+  Look for a chapter in the cache. Returns TRUE if it is there, complete
+  or in need only of compression. Either way, if the text can be hashed,
+  the key is kept, so that the compressor can cache the result.
+==========================================================================*/
+static BOOL pipeline_from_cache (Cache *cache, PipelineItem *item, 
+    const char *file, const char *title)
+  {
+  size_t len;
+  const char *text = item->input ? kmsinput_data (item->input, &len) : NULL;
+  if (!text) return FALSE;
+  cache_key (cache, &item->key, text, len, title, text_is_xhtml (file));
+  item->keyed = TRUE;
+  CacheEntry e;
+  if (!cache_get (cache, &item->key, &e)) return FALSE;
+  kmslog_debug ("Found %s in cache", file);
+  item->xhtml = e.xhtml;
+  item->deflated = e.deflated;
+  item->clen = e.clen;
+  item->len = e.len;
+  item->crc = e.crc;
+  item->cached = e.complete;
+  return TRUE;
+  }
+
+
+/*==========================================================================
+  pipeline_formatter 
+==========================================================================*/
+static void *pipeline_formatter (void *arg)
+  {
+  Pipeline *p = arg;
+  const PipelineBook *b = p->book;
+  PipelineItem *item;
+  while ((item = kmsqueue_pop (p->read_q)))
+    {
+    if (item->stream)
+      {
+      kmsqueue_push (p->format_q, item);
+      continue;
+      }
+    const char *title = pipeline_title (b, item->index, item->input);
+    if (!b->cache || !pipeline_from_cache (b->cache, item, 
+         b->files[item->index], title))
+      item->xhtml = text_input_to_xhtml (item->input, 
+        b->files[item->index], title, b->indent_is_para, b->markdown, 
+        b->first_is_title, b->line_paras, b->remove_pagenum, 
+        b->para_indent, p->chunk_jobs, PIPELINE_STREAM_MIN, &item->crc);
+    if (!item->xhtml && !item->deflated)
+      {
+      kmslog_debug ("%s is too big to convert in memory", 
+        b->files[item->index]);
+      item->stream = TRUE;
+      }
+    if (item->input)
+      kmsinput_close (item->input);
+    item->input = NULL;
+    kmsqueue_push (p->format_q, item);
+    }
+  // The last formatter to finish tells the compressors
+  int i;
+  if (__atomic_sub_fetch (&p->formatters_left, 1, __ATOMIC_ACQ_REL) == 0)
+    for (i = 0; i < p->jobs; i++)
+      kmsqueue_push (p->format_q, NULL);
+  return NULL;
+  }
+
+
+/*==========================================================================
+  pipeline_compressor 
+==========================================================================*/
+static void *pipeline_compressor (void *arg)
+  {
+  Pipeline *p = arg;
+  PipelineItem *item;
+  while ((item = kmsqueue_pop (p->format_q)))
+    {
+    if (item->stream || item->cached)
+      {
+      kmsqueue_push (p->compress_q, item);
+      continue;
+      }
+    const char *s = kmsstring_cstr (item->xhtml);
+    item->len = kmsstring_length (item->xhtml);
+    // A chapter that is not to be compressed, or that deflate would
+    //  make no smaller, is passed on as it is, to be stored
+    if (p->book->level != 0)
+      {
+      if (p->book->rsyncable)
+        item->deflated = kmszip_deflate_rsyncable (s, item->len, 
+          p->book->level, p->book->block_size, p->chunk_jobs, 
+          &item->clen, NULL);
+      else
+        item->deflated = kmszip_deflate_blocks (s, item->len, 
+          p->book->level, p->book->block_size, p->chunk_jobs, 
+          &item->clen, NULL);
+      if (!item->deflated)
+        item->failed = TRUE;
+      else if (item->clen >= item->len)
+        {
+        free (item->deflated);
+        item->deflated = NULL;
+        }
+      }
+    if (item->keyed && !item->failed)
+      {
+      CacheEntry e = { item->xhtml, item->deflated, item->clen, item->len,
+        item->crc, TRUE };
+      cache_put (p->book->cache, &item->key, &e);
+      }
+    // Only a chapter that is to be stored needs its XHTML any more
+    if (item->deflated || item->failed)
+      {
+      kmsstring_destroy (item->xhtml);
+      item->xhtml = NULL;
+      }
+    kmsqueue_push (p->compress_q, item);
+    }
+  // The last compressor to finish tells the writer
+  if (__atomic_sub_fetch (&p->compressors_left, 1, __ATOMIC_ACQ_REL) == 0)
+    kmsqueue_push (p->compress_q, NULL);
+  return NULL;
+  }
+
+
+/*==========================================================================
+  pipeline_sink 
+==========================================================================*/
+static BOOL pipeline_sink (const char *data, size_t len, void *arg)
+  {
+  return kmszip_entry_write ((KMSZip *)arg, data, len);
+  }
+
+
+/*==========================================================================
+  pipeline_stream_chapter
+  Read, format, and compress chapter i in pieces, straight into the 
+  archive, from input, or from the file opened again if input is NULL.
+  The input is closed. Returns FALSE if the archive could not be written.
+==========================================================================*/
+static BOOL pipeline_stream_chapter (const PipelineBook *b, KMSZip *zip, 
+    int i, KMSInput *input)
+  {
+  kmslog_debug ("Streaming %s", b->files[i]);
+  if (!input)
+    input = kmsinput_open_unmapped (b->files[i]);
+  off_t size = input ? kmsinput_size (input) : 0;
+  BOOL large = size < 0 || size >= PIPELINE_LARGE_ENTRY;
+
+  char name[32];
+  snprintf (name, sizeof (name), "file%d.html", i);
+  BOOL ret = kmszip_entry_begin (zip, name, b->level, large);
+  if (ret)
+    ret = text_input_to_sink (input, b->files[i], 
+      pipeline_title (b, i, input), b->indent_is_para, 
+      b->markdown, b->first_is_title, b->line_paras, b->remove_pagenum, 
+      b->para_indent, pipeline_sink, zip);
+  if (!kmszip_entry_end (zip)) 
+    ret = FALSE;
+  if (input) 
+    kmsinput_close (input);
+  return ret;
+  }
+
+
+/*==========================================================================
+  pipeline_log_queues 
+==========================================================================*/
+static void pipeline_log_queues (const Pipeline *p, int written)
+  {
+  kmslog_debug ("Wrote chapter %d; queued for formatting %d/%d, "
+    "compression %d/%d, writing %d/%d", written, 
+    kmsqueue_length (p->read_q), kmsqueue_capacity (p->read_q), 
+    kmsqueue_length (p->format_q), kmsqueue_capacity (p->format_q), 
+    kmsqueue_length (p->compress_q), kmsqueue_capacity (p->compress_q));
+  }
+
+
+/*==========================================================================
+  pipeline_start_threads 
+  Start up to n threads running fn, and return how many started. As in
+  kmsparallel_for, if a thread can't be started, we carry on with fewer.
+==========================================================================*/
+static int pipeline_start_threads (pthread_t *threads, int n, 
+    void *(*fn)(void *), Pipeline *p, const char *what)
+  {
+  int i, started = 0;
+  for (i = 0; i < n; i++)
+    {
+    if (pthread_create (&threads[started], NULL, fn, p) == 0)
+      started++;
+    else
+      kmslog_warning ("Can't start %s thread", what);
+    }
+  return started;
+  }
+
+
+/*==========================================================================
+  pipeline_run
+  Convert all the chapters of book, on up to jobs formatting threads, and
+  add them to zip as file0.html, file1.html... Returns FALSE if the 
+  archive could not be written. 
+==========================================================================*/
+BOOL pipeline_run (const PipelineBook *book, KMSZip *zip, int jobs)
+  {
+  BOOL ret = TRUE;
+  int i;
+  if (book->stream)
+    {
+    for (i = 0; i < book->count; i++)
+      {
+      if (!pipeline_stream_chapter (book, zip, i, NULL)) 
+        ret = FALSE;
+      if (book->crcs)
+        book->crcs[i] = kmszip_entry_crc (zip);
+      }
+    return ret;
+    }
+
+  Pipeline p;
+  memset (&p, 0, sizeof (p));
+  p.book = book;
+  p.jobs = jobs < book->count ? jobs : book->count;
+  if (p.jobs < 1) p.jobs = 1;
+  // With fewer chapters than jobs, the spare threads can share the work
+  //  of formatting each chapter
+  p.chunk_jobs = jobs > book->count && book->count > 0 ? 
+    jobs / book->count : 1;
+
+  p.window_min = PIPELINE_WINDOW_PER_JOB * p.jobs;
+  p.window_max = PIPELINE_WINDOW_MAX_PER_JOB * p.jobs;
+  p.window_bytes = PIPELINE_WINDOW_BYTES_PER_JOB * p.jobs;
+  pthread_mutex_init (&p.window_lock, NULL);
+  pthread_cond_init (&p.window_open, NULL);
+  int window = p.window_max;
+  p.read_q = kmsqueue_create ("read", window + p.jobs);
+  p.format_q = kmsqueue_create ("format", window + p.jobs);
+  p.compress_q = kmsqueue_create ("compress", window + 1);
+
+  // The stages are started from the end, and each is told how many 
+  //  threads it has before the one before it starts, since none can 
+  //  finish until that one has. If a stage gets no threads at all, 
+  //  those that did start are told that there is no more to do, and 
+  //  nothing is converted.
+  pthread_t reader, *formatters, *compressors;
+  formatters = malloc (p.jobs * sizeof (pthread_t));
+  compressors = malloc (p.jobs * sizeof (pthread_t));
+  int compressing = pipeline_start_threads (compressors, p.jobs, 
+    pipeline_compressor, &p, "compressor");
+  p.compressors_left = compressing;
+  int formatting = compressing == 0 ? 0 : pipeline_start_threads 
+    (formatters, p.jobs, pipeline_formatter, &p, "formatter");
+  p.formatters_left = formatting;
+  int reading = formatting == 0 ? 0 : pipeline_start_threads 
+    (&reader, 1, pipeline_reader, &p, "reader");
+  if (reading == 0)
+    {
+    kmslog_error ("Can't start threads to convert chapters");
+    ret = FALSE;
+    if (formatting > 0)
+      for (i = 0; i < p.jobs; i++)
+        kmsqueue_push (p.read_q, NULL);
+    else if (compressing > 0)
+      for (i = 0; i < p.jobs; i++)
+        kmsqueue_push (p.format_q, NULL);
+    else
+      kmsqueue_push (p.compress_q, NULL);
+    }
+  else
+    kmslog_debug ("Pipeline started with %d formatting and %d "
+      "compressing threads", formatting, compressing);
+
+  // Chapters arrive in the order they finish, so any that come before 
+  //  their turn wait in pending 
+  PipelineItem **pending = calloc (book->count, sizeof (PipelineItem *));
+  int next = 0;
+  PipelineItem *item;
+  while ((item = kmsqueue_pop (p.compress_q)))
+    {
+    pending[item->index] = item;
+    while (next < book->count && pending[next])
+      {
+      item = pending[next];
+      size_t size = item->size;
+      char name[32];
+      snprintf (name, sizeof (name), "file%d.html", next);
+      if (item->stream)
+        {
+        if (!pipeline_stream_chapter (book, zip, next, item->input))
+          ret = FALSE;
+        }
+      else if (item->failed)
+        {
+        kmslog_error ("Can't compress %s", book->files[next]);
+        ret = FALSE;
+        }
+      else if (item->xhtml)
+        {
+        if (!kmszip_add_stored (zip, name, kmsstring_cstr (item->xhtml), 
+             item->len, item->crc))
+          ret = FALSE;
+        kmsstring_destroy (item->xhtml);
+        }
+      else if (!kmszip_add_deflated (zip, name, item->deflated, item->clen, 
+           item->len, item->crc))
+        ret = FALSE;
+      if (book->crcs)
+        book->crcs[next] = kmszip_entry_crc (zip);
+      free (item->deflated);
+      free (item);
+      pending[next] = NULL;
+      pipeline_log_queues (&p, next);
+      next++;
+      pthread_mutex_lock (&p.window_lock);
+      p.in_flight--;
+      p.in_flight_bytes -= size;
+      if (pipeline_window_open (&p))
+        pthread_cond_signal (&p.window_open);
+      pthread_mutex_unlock (&p.window_lock);
+      }
+    }
+
+  if (reading > 0)
+    pthread_join (reader, NULL);
+  for (i = 0; i < formatting; i++)
+    pthread_join (formatters[i], NULL);
+  for (i = 0; i < compressing; i++)
+    pthread_join (compressors[i], NULL);
+
+  kmsqueue_log_stats (p.read_q);
+  kmsqueue_log_stats (p.format_q);
+  kmsqueue_log_stats (p.compress_q);
+
+  free (pending);
+  free (formatters);
+  free (compressors);
+  kmsqueue_destroy (p.read_q);
+  kmsqueue_destroy (p.format_q);
+  kmsqueue_destroy (p.compress_q);
+  pthread_cond_destroy (&p.window_open);
+  pthread_mutex_destroy (&p.window_lock);
+  return ret;
+  }
+
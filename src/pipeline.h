@@ -0,0 +1,41 @@
+/*==========================================================================
+txt2epub
+pipeline.h
+Copyright (c)2024 Kevin Boone, GPLv3.0
+*==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "kmsconstants.h"
+#include "kmslist.h"
+#include "kmszip.h"
+#include "cache.h"
+
+// The chapters of a book, and how to format them
+typedef struct _PipelineBook
+  {
+  char **files;           // Input files, in spine order
+  int count;
+  KMSList *titles;        // Chapter titles, in the same order; not
+                          //  changed while the pipeline runs
+  char **first_lines;     // If not NULL, filled in with the first line
+                          //  of each chapter, or NULL if it has none, 
+                          //  to use as its title instead
+  BOOL indent_is_para;
+  BOOL markdown;
+  BOOL first_is_title;
+  BOOL line_paras;
+  BOOL remove_pagenum;
+  BOOL para_indent;
+  BOOL stream;            // Stream every chapter; see pipeline.c
+  size_t block_size;      // Deflate big chapters in blocks of this size
+  int level;              // Compression level, as kmszip
+  BOOL rsyncable;         // See kmszip_deflate_rsyncable
+  Cache *cache;           // Converted chapters, or NULL
+  uint32_t *crcs;         // If not NULL, filled in with the CRC-32 of
+                          //  each chapter's XHTML, as it is written
+  } PipelineBook;
+
+BOOL pipeline_run (const PipelineBook *book, KMSZip *zip, int jobs);
+
@@ -15,12 +15,20 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
-#include <pcre.h>
+#include <pthread.h>
+#include <ctype.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
 #include <sys/stat.h>
 #include "kmsconstants.h" 
 #include "kmslogging.h" 
 #include "kmsstring.h" 
 #include "kmslist.h" 
+#include "kmsarena.h" 
+#include "kmsinput.h" 
+#include "kmsscan.h" 
+#include "kmsparallel.h" 
+#include "kmscrc.h" 
 #include "text.h" 
 
 // We insert into the text file a single byte that represents the
@@ -37,21 +45,130 @@
 //  to handle such files.
 #define VERBATIM_BYTE 0xC0
 
-static pcre *re_italic, *re_bold, *re_indent, *re_verbatim,
+// Limits on the work pcre2_match can do for each match. None of our
+//  patterns should ever backtrack much, but the verbatim marker comes 
+//  from the user. A lazy pattern like _.*?_ counts a step or two for 
+//  every character it passes over, so the match limit is set for each 
+//  line, at TEXT_MATCH_PER_BYTE steps per byte, but never less than 
+//  TEXT_MATCH_MIN. Anything that needs more than that is backtracking
+//  badly, and giving up on it bounds the time spent on each line by 
+//  the line's length, rather than by a fixed and much larger count.
+#define TEXT_MATCH_PER_BYTE 16
+#define TEXT_MATCH_MIN 100000
+#define TEXT_DEPTH_LIMIT 10000
+
+// The block size for the per-chapter arena. This is enough for all the
+//  temporary text for a line of a few kilobytes. Longer lines get blocks
+//  of their own, which are then kept for reuse.
+#define TEXT_ARENA_BLOCK 65536
+
+// A large file is divided into chunks of at least TEXT_CHUNK_MIN bytes,
+//  TEXT_CHUNKS_PER_JOB for each thread, to be formatted in parallel. 
+//  Chunks end after a blank line, if there is one within 
+//  TEXT_SPLIT_SEARCH bytes of where we'd like to split. 
+#define TEXT_CHUNK_MIN (1024 * 1024)
+#define TEXT_CHUNKS_PER_JOB 4
+#define TEXT_SPLIT_SEARCH 65536
+
+// When streaming, formatted text is handed on in pieces of about this
+//  size
+#define TEXT_FLUSH_SIZE (256 * 1024)
+
+// Otherwise, the CRC of the formatted text is brought up to date every
+//  time this much more has been added, while it's still in the cache
+#define TEXT_CRC_SIZE (32 * 1024)
+
+// Where formatted text goes: either into xml, which grows to hold the
+//  whole document, keeping track of its CRC-32 as it goes; or, if there 
+//  is a sink, into xml a piece at a time, on the way to the sink
+typedef struct _TextOut
+  {
+  KMSString *xml;
+  TextSink sink;
+  void *arg;
+  uint32_t crc;         // CRC of xml, up to 'counted'
+  size_t counted;
+  size_t max;           // If not 0, give up once xml is longer than this
+  } TextOut;
+
+static pcre2_code *re_italic, *re_bold, *re_indent, *re_verbatim,
             *re_h1, *re_h2, *re_h3, *re_br, *re_pagenum;
+static pcre2_match_context *match_context;
+
+// pcre2_match needs somewhere to put its results, and a match context
+//  whose limit suits the line. Creating these for every match is 
+//  expensive, so each thread has its own, created when it first needs 
+//  them. No pattern has capturing groups, so one pair of offsets is 
+//  enough for all of them. They are also stored under match_data_key, 
+//  only so that they get freed when the thread exits. Everything else 
+//  set up by text_init_regex is read-only afterwards, so any number of 
+//  threads can format text at the same time.
+typedef struct _TextMatch
+  {
+  pcre2_match_data *data;
+  pcre2_match_context *context;
+  } TextMatch;
+
+static __thread TextMatch *match_data;
+static pthread_key_t match_data_key;
+
+
+// If the verbatim marker is plain text, rather than something that 
+//  only makes sense as a regular expression, we can match it with
+//  memcmp, and format each line in a single pass. 
+static char *verbatim_literal = NULL;
+static int verbatim_literal_len = 0;
+
+// Sets of bytes that need attention, so the bytes between them can be
+//  found and copied many at a time. The fused formatter stops for XHTML
+//  specials and verbatim markers and, with Markdown, emphasis markers.
+//  md_set is the order of the MD_ bits in the result of kmsscan_present.
+static KMSScanSet escape_set, md_set, fused_set, fused_md_set;
+#define MD_BOLD    1
+#define MD_ITALIC  2
+#define MD_HEADING 4
 
 /*==========================================================================
-  strip_cr 
-  // TODO -- remove them completely, rather than just turning them into
-  //  spaces
+  text_compile_regex 
+  Compile a regular expression and, if the platform supports it, JIT-
+  compile it as well. If JIT compilation fails, pcre2_match will just
+  use the interpreter. 
 ==========================================================================*/
-static void strip_cr (char *s)
+static pcre2_code *text_compile_regex (const char *pattern, uint32_t options)
   {
-  while (*s)
+  int error;
+  PCRE2_SIZE offset;
+  pcre2_code *re = pcre2_compile ((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+    options, &error, &offset, NULL);
+  if (re)
+    {
+    int jit = pcre2_jit_compile (re, PCRE2_JIT_COMPLETE);
+    if (jit != 0)
+      kmslog_debug ("Can't JIT-compile regular expression %s (error %d)", 
+        pattern, jit);
+    }
+  else
     {
-    if (*s == 13) *s = ' ';
-    s++;
+    PCRE2_UCHAR message[256];
+    pcre2_get_error_message (error, message, sizeof (message));
+    kmslog_error ("Bad regular expression %s at offset %d: %s", 
+      pattern, (int)offset, message);
     }
+  return re;
+  }
+
+
+/*==========================================================================
+  text_free_match_data
+  Called when a thread exits without calling text_cleanup_thread, and
+  by text_cleanup_thread itself
+==========================================================================*/
+static void text_free_match_data (void *data)
+  {
+  TextMatch *m = data;
+  pcre2_match_data_free (m->data);
+  pcre2_match_context_free (m->context);
+  free (m);
   }
 
 
@@ -62,585 +179,891 @@ static void strip_cr (char *s)
 ==========================================================================*/
 void text_init_regex (const char *verbatim_marker)
   {
-   const char *pcreErrorStr;
-  int pcreErrorOffset = 0;
+  re_italic = text_compile_regex ("_.*?_", PCRE2_EXTENDED); 
 
-  re_italic = pcre_compile ("_.*?_", PCRE_EXTENDED, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_bold = text_compile_regex ("\\*.*?\\*", PCRE2_EXTENDED); 
 
-  re_bold = pcre_compile ("\\*.*?\\*", PCRE_EXTENDED, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_indent = text_compile_regex ("^\\s\\s\\s+", PCRE2_EXTENDED); 
 
-  re_indent = pcre_compile ("^\\s\\s\\s+", PCRE_EXTENDED, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_h1 = text_compile_regex ("^#.*$", 0); 
 
-  re_h1 = pcre_compile ("^#.*$", 0, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_h2 = text_compile_regex ("^##.*$", 0); 
 
-  re_h2 = pcre_compile ("^##.*$", 0, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_h3 = text_compile_regex ("^###.*$", 0); 
 
-  re_h3 = pcre_compile ("^###.*$", 0, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_br = text_compile_regex ("  $", 0); 
 
-  re_br = pcre_compile ("  $", 0, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_pagenum = text_compile_regex ("^\\s\\s+\\d+", 0); 
 
-  re_pagenum = pcre_compile ("^\\s\\s+\\d+", 0, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  re_verbatim = text_compile_regex (verbatim_marker, 0); 
 
-  re_verbatim = pcre_compile (verbatim_marker, 0, 
-    &pcreErrorStr, &pcreErrorOffset, NULL);
+  pthread_key_create (&match_data_key, text_free_match_data);
+  match_context = pcre2_match_context_create (NULL);
+  pcre2_set_match_limit (match_context, TEXT_MATCH_MIN);
+  pcre2_set_depth_limit (match_context, TEXT_DEPTH_LIMIT);
+
+  if (verbatim_marker[0] && !strpbrk (verbatim_marker, "\\^$.[]|()?*+{}"))
+    {
+    verbatim_literal = strdup (verbatim_marker);
+    verbatim_literal_len = strlen (verbatim_marker);
+    }
+
+  kmsscan_init ();
+  kmsscan_set_init (&escape_set, "&<>\xC0", 4);
+  kmsscan_set_init (&md_set, "*_#", 3);
+  if (verbatim_literal)
+    {
+    char fused[] = "&<>\xC0?*_";
+    fused[4] = verbatim_literal[0];
+    kmsscan_set_init (&fused_set, fused, 5);
+    kmsscan_set_init (&fused_md_set, fused, 7);
+    }
+  }
+
+
+/*==========================================================================
+  text_cleanup_thread
+  Free the match data belonging to the calling thread. Any thread that
+  has formatted text should call this before it exits.
+==========================================================================*/
+void text_cleanup_thread (void)
+  {
+  if (match_data)
+    text_free_match_data (match_data);
+  match_data = NULL;
+  pthread_setspecific (match_data_key, NULL);
   }
 
 
+
 /*==========================================================================
   text_cleanup_regex 
 ==========================================================================*/
 void text_cleanup_regex(void)
   {
-  if (re_italic)
-    pcre_free (re_italic);
-  if (re_bold)
-    pcre_free (re_bold);
-  if (re_indent)
-    pcre_free (re_indent);
-  if (re_h1)
-    pcre_free (re_h1);
-  if (re_h2)
-    pcre_free (re_h2);
-  if (re_h3)
-    pcre_free (re_h3);
-  if (re_br)
-    pcre_free (re_br);
-  if (re_pagenum)
-    pcre_free (re_pagenum);
-  if (re_verbatim)
-    pcre_free (re_verbatim);
+  pcre2_code_free (re_italic);
+  pcre2_code_free (re_bold);
+  pcre2_code_free (re_indent);
+  pcre2_code_free (re_h1);
+  pcre2_code_free (re_h2);
+  pcre2_code_free (re_h3);
+  pcre2_code_free (re_br);
+  pcre2_code_free (re_pagenum);
+  pcre2_code_free (re_verbatim);
+  pcre2_match_context_free (match_context);
+  match_context = NULL;
+  text_cleanup_thread ();
+  pthread_key_delete (match_data_key);
+  if (verbatim_literal)
+    free (verbatim_literal);
+  verbatim_literal = NULL;
+  verbatim_literal_len = 0;
   }
 
 
 /*==========================================================================
-  TODO: all these 'text_subs_xxx' functions use essentially the same
-  logic. Ideally, I should write a single function, with relevant
-  arguments. Unfortunately, there's just enough disparity between these
-  functions to make this a little awkward. 
+  TextSubs
+  Describes what text_subs replaces each match of a regular expression
+  with: the open text, then the match with 'head' bytes removed from
+  the start and 'tail' bytes from the end (if keep is TRUE), then
+  the close text. 
 ==========================================================================*/
+typedef struct _TextSubs
+  {
+  const char *open;
+  int head;
+  int tail;
+  BOOL keep;
+  const char *close;
+  } TextSubs;
+
+static const TextSubs subs_br       = { "<br/>", 0, 0, FALSE, "" };
+static const TextSubs subs_indent   = { "</p><p>", 0, 0, FALSE, "" };
+static const TextSubs subs_italic   = { "<i>", 1, 1, TRUE, "</i>" };
+static const TextSubs subs_bold     = { "<b>", 1, 1, TRUE, "</b>" };
+static const TextSubs subs_h3       = { "<h3>", 3, 0, TRUE, "</h3>" };
+static const TextSubs subs_h2       = { "<h2>", 2, 0, TRUE, "</h2>" };
+static const TextSubs subs_h1       = { "<h1>", 1, 0, TRUE, "</h1>" };
+static const TextSubs subs_verbatim = { "\xC0", 0, 0, FALSE, "" };
+static const TextSubs subs_pagenum  = { "", 0, 0, FALSE, "" };
+
 /*==========================================================================
-  text_subs_br
+  text_subs_bound
+  The most bytes text_subs can write: two-byte bold pairs become seven 
+  bytes, and anchored patterns add their open and close text once. 
 ==========================================================================*/
-static char *text_subs_br (const char *_input)
+static int text_subs_bound (int len, const TextSubs *subs)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
-
-  while (!done)
-    {
-    int vec[10];
-    int count = pcre_exec (re_br, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
-
-    if (count != 1) done = TRUE;
-    if (!done)
-      {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input+ vec[0]+1);
-      subs [vec[1] - vec[0] - 2] = 0;
-      kmsstring_append (s, "<br/>");
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
-      }
-    }
-
-  kmsstring_append (s, input);
-
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
+  return 4 * len + strlen (subs->open) + strlen (subs->close);
   }
 
 
 /*==========================================================================
-  text_subs_indent
+  text_subs
+  Replace every match of re in input, as described by subs, writing the
+  result to out, which must have room for text_subs_bound bytes. Returns
+  the number of bytes written. Text between matches, and the text kept
+  from each match, are copied directly from the input, so each line 
+  costs time in proportion to its length, however many matches it has. 
+
+  The subject passed to pcre2_match starts just after the previous match,
+  rather than using a start offset, so that patterns anchored with '^'
+  can match again after a replacement -- page number removal relies on
+  this to remove several page numbers at the start of a line. 
 ==========================================================================*/
-static char *text_subs_indent (const char *_input)
+static int text_subs (const pcre2_code *re, KMSStringView input, 
+    const TextSubs *subs, char *out)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
-
-  while (!done)
+  if (!match_data)
+    {
+    match_data = malloc (sizeof (TextMatch));
+    match_data->data = pcre2_match_data_create (1, NULL);
+    match_data->context = pcre2_match_context_copy (match_context);
+    pthread_setspecific (match_data_key, match_data);
+    }
+  uint32_t limit = TEXT_MATCH_MIN;
+  if (input.len >= UINT32_MAX / TEXT_MATCH_PER_BYTE)
+    limit = UINT32_MAX;
+  else if (input.len > TEXT_MATCH_MIN / TEXT_MATCH_PER_BYTE)
+    limit = (uint32_t)input.len * TEXT_MATCH_PER_BYTE;
+  pcre2_set_match_limit (match_data->context, limit);
+
+  char *p = out;
+  KMSStringView rest = input;
+  while (re && rest.len >= 0)
     {
-    int vec[10];
-    int count = pcre_exec (re_indent, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
+    int count = pcre2_match (re, (PCRE2_SPTR)rest.str, rest.len,  
+       0, 0, match_data->data, match_data->context);         
+    if (count < 0) 
+      {
+      if (count != PCRE2_ERROR_NOMATCH)
+        kmslog_warning ("Regular expression failed (error %d) -- "
+          "line not fully formatted", count);
+      break;
+      }
 
-    if (count != 1) done = TRUE;
-    if (!done)
+    PCRE2_SIZE *vec = pcre2_get_ovector_pointer (match_data->data);
+    int start = vec[0];
+    int end = vec[1];
+    p = mempcpy (p, rest.str, start);
+    p = stpcpy (p, subs->open);
+    if (subs->keep)
+      p = mempcpy (p, rest.str + start + subs->head, 
+        end - start - subs->head - subs->tail);
+    p = stpcpy (p, subs->close);
+
+    if (end == start)
       {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input+ vec[0]+1);
-      subs [vec[1] - vec[0] - 2] = 0;
-      kmsstring_append (s, "</p>");
-      kmsstring_append (s, "");
-      kmsstring_append (s, "<p>");
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
+      // An empty match -- copy a byte, or we'll never move on
+      if (end < rest.len) *p++ = rest.str[end];
+      end++;
       }
+    rest.str += end;
+    rest.len -= end;
     }
 
-  kmsstring_append (s, input);
-
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
+  if (rest.len > 0)
+    p = mempcpy (p, rest.str, rest.len);
+  return p - out;
   }
 
 
 /*==========================================================================
-  text_subs_italic
+  escape_html 
+  For each line, we have to convert characters with a special meaning in
+  XHTML to escapes. However, we don't do this for text that lies between
+  verbatim markers, so we have to scan the text for these markers.
+  The verbatim markers are first replaced by VERBATIM_BYTE. Temporary 
+  memory comes from arena; the result is written to out, which must
+  have room for five bytes (&amp;) for each byte of line. Returns the
+  number of bytes written.
 ==========================================================================*/
-static char *text_subs_italic (const char *_input)
+static int escape_html (KMSStringView line, KMSArena *arena, char *out)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
+  char *line1 = kmsarena_alloc (arena, 
+    text_subs_bound (line.len, &subs_verbatim));
+  int len1 = text_subs (re_verbatim, line, &subs_verbatim, line1);
 
-  while (!done)
+  char *p = out;
+  BOOL verbatim = FALSE;
+  int i = 0;
+  while (i < len1)
     {
-    int vec[10];
-    int count = pcre_exec (re_italic, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
-
-    if (count != 1) done = TRUE;
-    if (!done)
+    int run = kmsscan_find (&escape_set, line1 + i, len1 - i);
+    p = mempcpy (p, line1 + i, run);
+    i += run;
+    if (i == len1) break;
+    switch ((unsigned char)line1[i++])
       {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input+ vec[0]+1);
-      subs [vec[1] - vec[0] - 2] = 0;
-      kmsstring_append (s, "<i>");
-      kmsstring_append (s, subs);
-      kmsstring_append (s, "</i>");
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
-      }
-    }
+      case '&':
+        if (verbatim)
+          *p++ = '&'; 
+        else
+          p = stpcpy (p, "&amp;"); 
+        break;
 
-  kmsstring_append (s, input);
+      case '>':
+        if (verbatim)
+          *p++ = '>'; 
+        else
+          p = stpcpy (p, "&gt;"); 
+        break;
 
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
-  }
+      case '<':
+        if (verbatim)
+          *p++ = '<'; 
+        else
+          p = stpcpy (p, "&lt;"); 
+        break;
 
+      case VERBATIM_BYTE: 
+        verbatim = !verbatim;
+        break;
+      }
+    }
+  return p - out;
+  }
 
 /*==========================================================================
-  text_subs_h3
+  format_line_regex
+  Format a line by running it through each of the regular expressions 
+  in turn, and append the result to out. This is the general case, 
+  needed only when the verbatim marker is a real regular expression.
+  The output of each stage but the last is temporary, and comes from 
+  arena; the last stage writes straight into out.
+  Note -- line may (in theory) be a magabyte long
 ==========================================================================*/
-static char *text_subs_h3 (const char *_input)
+static void format_line_regex (KMSString *out, KMSArena *arena,
+    KMSStringView line, BOOL indent_is_para, BOOL markdown, 
+    BOOL remove_pagenum, BOOL first_line)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
-
-  while (!done)
+  const pcre2_code *stages[8];
+  const TextSubs *stage_subs[8];
+  int nstages = 0;
+
+  char *buff = kmsarena_alloc (arena, 5 * line.len);
+  KMSStringView text = kmsstringview_create (buff, 
+    escape_html (line, arena, buff));
+
+  // Leave out the stages that can't possibly match. None of the 
+  //  substitutions adds leading whitespace, trailing spaces, or 
+  //  Markdown markers, so we can tell from the escaped text alone. 
+  //  Most lines of most books have no Markdown in them at all.
+  BOOL lead_ws = text.len > 0 && isspace ((unsigned char)text.str[0]);
+  if (remove_pagenum && lead_ws)
     {
-    int vec[10];
-    int count = pcre_exec (re_h3, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
-
-    if (count != 1) done = TRUE;
-    if (!done)
+    stages[nstages] = re_pagenum; stage_subs[nstages++] = &subs_pagenum;
+    }
+  if (markdown)
+    {
+    unsigned md = kmsscan_present (&md_set, text.str, text.len);
+    int end = text.len;
+    if (end > 0 && text.str[end - 1] == '\n') end--;
+    BOOL br = end >= 2 && text.str[end - 1] == ' ' 
+        && text.str[end - 2] == ' ';
+    if (md & MD_BOLD)
+      {
+      stages[nstages] = re_bold; stage_subs[nstages++] = &subs_bold;
+      }
+    if (md & MD_ITALIC)
+      {
+      stages[nstages] = re_italic; stage_subs[nstages++] = &subs_italic;
+      }
+    if (md & MD_HEADING)
       {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input + vec[0]+3);
-      subs [vec[1] - vec[0] - 3] = 0;
-      kmsstring_append (s, "<h3>");
-      kmsstring_append (s, subs);
-      kmsstring_append (s, "</h3>");
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
+      stages[nstages] = re_h3; stage_subs[nstages++] = &subs_h3;
+      stages[nstages] = re_h2; stage_subs[nstages++] = &subs_h2;
+      stages[nstages] = re_h1; stage_subs[nstages++] = &subs_h1;
       }
+    if (br)
+      {
+      stages[nstages] = re_br; stage_subs[nstages++] = &subs_br;
+      }
+    }
+  if (indent_is_para && !first_line && lead_ws)
+    {
+    // Don't process indents as para breaks if this is the first
+    //   line of the file
+    stages[nstages] = re_indent; stage_subs[nstages++] = &subs_indent;
+    }
+
+  if (nstages == 0)
+    {
+    kmsstring_append_view (out, text);
+    return;
     }
 
-  kmsstring_append (s, input);
+  int i;
+  for (i = 0; i < nstages; i++)
+    {
+    int bound = text_subs_bound (text.len, stage_subs[i]);
+    if (i == nstages - 1)
+      buff = kmsstring_append_begin (out, bound);
+    else
+      buff = kmsarena_alloc (arena, bound);
+    text = kmsstringview_create (buff, 
+      text_subs (stages[i], text, stage_subs[i], buff));
+    }
 
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
+  kmsstring_append_end (out, text.len);
   }
 
 /*==========================================================================
-  text_subs_h2
+  FusedState 
+  The state carried from one byte of the line to the next by
+  format_line_fused.
 ==========================================================================*/
-static char *text_subs_h2 (const char *_input)
+typedef enum
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
+  PHASE_PREFIX = 0, // Still in leading whitespace (or page number)
+  PHASE_HASHES,     // Counting the '#' characters of a heading
+  PHASE_BODY        // Everything else
+  } FusedPhase;
 
-  while (!done)
-    {
-    int vec[10];
-    int count = pcre_exec (re_h2, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
+typedef struct _FusedState
+  {
+  char *out;
+  size_t n;
+  FusedPhase phase;
+  BOOL indent;          // Leading whitespace means a paragraph break
+  BOOL markdown;
+  BOOL remove_pagenum;
+  int lead_ws;          // Whitespace bytes since the start of the line 
+  BOOL pn_digits;       // TRUE if we're in the digits of a page number 
+  int hashes;           // Heading level, once the phase is PHASE_BODY
+  long bold_at;         // Offset in out of an unclosed <b>, or -1 
+  long italic_at;       // Offset in out of an unclosed <i>, or -1 
+  } FusedState;
 
-    if (count != 1) done = TRUE;
-    if (!done)
-      {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input + vec[0]+2);
-      subs [vec[1] - vec[0] - 2] = 0;
-      kmsstring_append (s, "<h2>");
-      kmsstring_append (s, subs);
-      kmsstring_append (s, "</h2>");
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
-      }
-    }
+/*==========================================================================
+  fused_is_space 
+  The same characters as \s in the regular expressions
+==========================================================================*/
+static inline BOOL fused_is_space (int c)
+  {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' 
+    || c == '\f' || c == '\r';
+  }
 
-  kmsstring_append (s, input);
+/*==========================================================================
+  fused_emit 
+==========================================================================*/
+static inline void fused_emit (FusedState *st, const char *s, int len)
+  {
+  memcpy (st->out + st->n, s, len);
+  st->n += len;
+  }
 
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
+/*==========================================================================
+  fused_patch 
+  Replace the len bytes at offset at with the single character c. We need
+  to do this when an opening Markdown marker turns out to have no
+  matching closing marker, so it must be output as it was. 
+==========================================================================*/
+static void fused_patch (FusedState *st, long at, int len, char c)
+  {
+  st->out[at] = c;
+  memmove (st->out + at + 1, st->out + at + len, st->n - at - len);
+  st->n -= len - 1;
   }
 
 /*==========================================================================
-  text_subs_h1
+  fused_open_heading
 ==========================================================================*/
-static char *text_subs_h1 (const char *_input)
+static void fused_open_heading (FusedState *st)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
+  char tag[] = "<h0>";
+  tag[2] = '0' + st->hashes;
+  fused_emit (st, tag, 4);
+  st->phase = PHASE_BODY;
+  }
 
-  while (!done)
+/*==========================================================================
+  fused_byte 
+  Process one byte of the line, after verbatim markers have been removed.
+  c is the original byte, and s/len is what it turns into after XHTML
+  escaping. The markup this produces is exactly what the sequence
+  pagenum, bold, italic, h3, h2, h1, br, indent of regular expression
+  substitutions would produce -- see format_line_regex. 
+==========================================================================*/
+static void fused_byte (FusedState *st, int c, const char *s, int len)
+  {
+  if (st->phase == PHASE_PREFIX)
     {
-    int vec[10];
-    int count = pcre_exec (re_h1, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
+    if (st->pn_digits)
+      {
+      if (c >= '0' && c <= '9') 
+        {
+        fused_emit (st, s, len);
+        return;
+        }
+      // The page number is complete -- throw it away, and start again
+      //  as if this were the start of the line
+      st->n = 0;
+      st->lead_ws = 0;
+      st->pn_digits = FALSE;
+      }
+    if (fused_is_space (c))
+      {
+      fused_emit (st, s, len);
+      st->lead_ws++;
+      return;
+      }
+    if (st->remove_pagenum && st->lead_ws >= 2 && c >= '0' && c <= '9')
+      {
+      fused_emit (st, s, len);
+      st->pn_digits = TRUE;
+      return;
+      }
 
-    if (count != 1) done = TRUE;
-    if (!done)
+    // This is the first byte of real text
+    st->phase = PHASE_BODY;
+    if (st->indent && st->lead_ws >= 3)
+      {
+      st->n = 0;
+      fused_emit (st, "</p><p>", 7);
+      }
+    if (st->markdown && st->lead_ws == 0 && c == '#')
       {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input + vec[0]+1);
-      subs [vec[1] - vec[0] - 1] = 0;
-      kmsstring_append (s, "<h1>");
-      kmsstring_append (s, subs);
-      kmsstring_append (s, "</h1>");
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
+      st->phase = PHASE_HASHES;
+      st->hashes = 1;
+      return;
       }
     }
+  else if (st->phase == PHASE_HASHES)
+    {
+    if (c == '#' && st->hashes < 3)
+      {
+      st->hashes++;
+      return;
+      }
+    fused_open_heading (st);
+    }
 
-  kmsstring_append (s, input);
-
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
+  if (st->markdown && c == '*')
+    {
+    if (st->bold_at < 0)
+      {
+      st->bold_at = st->n;
+      fused_emit (st, "<b>", 3);
+      }
+    else
+      {
+      st->bold_at = -1;
+      fused_emit (st, "</b>", 4);
+      }
+    }
+  else if (st->markdown && c == '_')
+    {
+    if (st->italic_at < 0)
+      {
+      st->italic_at = st->n;
+      fused_emit (st, "<i>", 3);
+      }
+    else
+      {
+      st->italic_at = -1;
+      fused_emit (st, "</i>", 4);
+      }
+    }
+  else
+    fused_emit (st, s, len);
   }
 
-
 /*==========================================================================
-  text_subs_verbatim
-  Replace the (maybe) multi-byte verbatim marker with the single byte
-  VERBATIM_BYTE
+  fused_end 
+  Finish off the line, once all the bytes have been seen. 
 ==========================================================================*/
-static char *text_subs_verbatim (const char *_input)
+static void fused_end (FusedState *st)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
-
-  while (!done)
+  if (st->phase == PHASE_PREFIX)
     {
-    int vec[10];
-    int count = pcre_exec (re_verbatim, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
-
-    if (count != 1) done = TRUE;
-    if (!done)
+    if (st->pn_digits)
+      {
+      st->n = 0;
+      st->lead_ws = 0;
+      }
+    // The line is all whitespace. A line break takes the last two
+    //  spaces, and then what is left might be a paragraph indent 
+    int ws = st->lead_ws;
+    BOOL br = st->markdown && st->n >= 2 && st->out[st->n - 1] == ' ' 
+        && st->out[st->n - 2] == ' ';
+    if (br) ws -= 2;
+    if (st->indent && ws >= 3)
       {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input+ vec[0]+1);
-      subs [vec[1] - vec[0] - 2] = 0;
-      kmsstring_append_c (s, VERBATIM_BYTE);
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
+      st->n = 0;
+      fused_emit (st, "</p><p>", 7);
       }
+    else
+      st->n = ws;
+    if (br) fused_emit (st, "<br/>", 5);
+    return;
     }
 
-  kmsstring_append (s, input);
+  if (st->phase == PHASE_HASHES)
+    fused_open_heading (st);
 
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
-  }
+  // Markers without a partner are output as they were. Patch the later 
+  //  one first, so the earlier offset stays valid 
+  if (st->bold_at > st->italic_at)
+    {
+    fused_patch (st, st->bold_at, 3, '*');
+    if (st->italic_at >= 0) fused_patch (st, st->italic_at, 3, '_');
+    }
+  else if (st->italic_at >= 0)
+    {
+    fused_patch (st, st->italic_at, 3, '_');
+    if (st->bold_at >= 0) fused_patch (st, st->bold_at, 3, '*');
+    }
 
+  if (st->hashes)
+    {
+    char tag[] = "</h0>";
+    tag[3] = '0' + st->hashes;
+    fused_emit (st, tag, 5);
+    }
+  else if (st->markdown && st->n >= 2 && st->out[st->n - 1] == ' ' 
+        && st->out[st->n - 2] == ' ')
+    {
+    st->n -= 2;
+    fused_emit (st, "<br/>", 5);
+    }
+  }
 
 /*==========================================================================
-  text_subs_bold
+  format_line_fused
+  Escape a line, and apply all the Markdown and paragraph formatting, in
+  a single scan, appending the result to out. No byte expands to more 
+  than five (&amp;), so we can make room in out once, up front, and 
+  write straight into it. 
 ==========================================================================*/
-static char *text_subs_bold (const char *_input)
+static void format_line_fused (KMSString *out, KMSStringView line, 
+    BOOL indent_is_para, BOOL markdown, BOOL remove_pagenum, 
+    BOOL first_line)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
-
-  while (!done)
+  const char *p = line.str;
+  int len = line.len;
+  FusedState st;
+  memset (&st, 0, sizeof (st));
+  st.out = kmsstring_append_begin (out, 5 * len + 16);
+  st.indent = indent_is_para && !first_line;
+  st.markdown = markdown;
+  st.remove_pagenum = remove_pagenum;
+  st.bold_at = -1;
+  st.italic_at = -1;
+
+  const KMSScanSet *set = markdown ? &fused_md_set : &fused_set;
+  BOOL verbatim = FALSE;
+  int i = 0;
+  while (i < len)
     {
-    int vec[10];
-    int count = pcre_exec (re_bold, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
-
-    if (count != 1) done = TRUE;
-    if (!done)
+    if (st.phase == PHASE_BODY)
+      {
+      // Past the start of the line, only the bytes in set mean anything,
+      //  so everything up to the next one can be copied as it is
+      int run = kmsscan_find (set, p + i, len - i);
+      fused_emit (&st, p + i, run);
+      i += run;
+      if (i == len) break;
+      }
+    if (p[i] == verbatim_literal[0] && len - i >= verbatim_literal_len && 
+         memcmp (p + i, verbatim_literal, verbatim_literal_len) == 0)
       {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input+ vec[0]+1);
-      subs [vec[1] - vec[0] - 2] = 0;
-      kmsstring_append (s, "<b>");
-      kmsstring_append (s, subs);
-      kmsstring_append (s, "</b>");
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
+      verbatim = !verbatim;
+      i += verbatim_literal_len;
+      continue;
       }
+    unsigned char c = p[i++];
+    if (c == VERBATIM_BYTE)
+      verbatim = !verbatim;
+    else if (c == '&' && !verbatim)
+      fused_byte (&st, c, "&amp;", 5);
+    else if (c == '<' && !verbatim)
+      fused_byte (&st, c, "&lt;", 4);
+    else if (c == '>' && !verbatim)
+      fused_byte (&st, c, "&gt;", 4);
+    else
+      fused_byte (&st, c, (const char *)&c, 1);
     }
 
-  kmsstring_append (s, input);
-
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
+  fused_end (&st);
+  kmsstring_append_end (out, st.n);
   }
 
-
 /*==========================================================================
-  text_subs_pagenum
-  Try to strip floating page numbers
+  format_line 
 ==========================================================================*/
-static char *text_subs_pagenum (const char *_input)
+static void format_line (KMSString *out, KMSArena *arena, 
+    KMSStringView line, BOOL indent_is_para, BOOL markdown, 
+    BOOL remove_pagenum, BOOL first_line)
   {
-  char *input = strdup (_input);
-  BOOL done = FALSE;
-  KMSString *s = kmsstring_create_empty ();
+  if (verbatim_literal)
+    format_line_fused (out, line, indent_is_para, markdown, 
+      remove_pagenum, first_line);
+  else
+    format_line_regex (out, arena, line, indent_is_para, markdown, 
+      remove_pagenum, first_line);
+  }
 
-  while (!done)
+/*==========================================================================
+  text_out_update
+  Hand what has been formatted to out's sink, if there is one, and 
+  empty xml; otherwise, bring the CRC up to date. Unless all is TRUE, 
+  nothing is done until there is enough new text to make it worthwhile.
+  Returns FALSE if the sink fails, or xml has grown past out->max.
+==========================================================================*/
+static BOOL text_out_update (TextOut *out, BOOL all)
+  {
+  size_t len = kmsstring_length (out->xml);
+  if (out->sink)
     {
-    int vec[10];
-    int count = pcre_exec (re_pagenum, NULL, input, strlen (input),  
-       0, 0, vec, 10);         
-
-    if (count != 1) done = TRUE;
-    if (!done)
-      {
-      char *temp = strdup (input);
-      temp[vec[0]] = 0;
-      kmsstring_append (s, temp);
-      free (temp);
-      char *subs = strdup (input+ vec[0]+1);
-      subs [vec[1] - vec[0] - 2] = 0;
-      //kmsstring_append (s, subs);
-      // Do nothing in this case -- just dump the whole thing
-      free (subs);
-      temp = strdup (input + vec[1]);
-      free (temp);
-      memmove (input, input + vec[1], strlen (input) - vec[1] + 1);
-      }
+    if (!all && len < TEXT_FLUSH_SIZE) return TRUE;
+    BOOL ret = out->sink (kmsstring_cstr (out->xml), len, out->arg);
+    kmsstring_truncate (out->xml, 0);
+    return ret;
     }
-
-  kmsstring_append (s, input);
-
-  char *t = strdup (kmsstring_cstr(s));
-  free (input);
-  kmsstring_destroy (s);
-  return t;
+  if (out->max && len > out->max) return FALSE;
+  if (!all && len - out->counted < TEXT_CRC_SIZE) return TRUE;
+  out->crc = kmscrc_update (out->crc, kmsstring_cstr (out->xml) 
+    + out->counted, len - out->counted);
+  out->counted = len;
+  return TRUE;
   }
 
-
 /*==========================================================================
-  escape_html 
-  For each line, we have to convert characters with a special meaning in
-  XHTML to escapes. However, we don't do this for text that lies between
-  verbatim markers, so we have to scan the text for these markers.
+  format_lines 
+  Format every line from input, appending the result to xml. first is 
+  TRUE if the first line from input is the first line of the file, 
+  which is treated differently. This is the only state carried from 
+  one line to the next, so a file can be formatted in pieces, as long
+  as each piece is a whole number of lines. We stop if out's sink fails,
+  or out grows past its maximum; either way, FALSE is returned.
 ==========================================================================*/
-static char *escape_html (const char *line)
+static BOOL format_lines (TextOut *out, KMSInput *input, BOOL first,
+     BOOL indent_is_para, BOOL markdown, BOOL first_is_title, 
+     BOOL line_paras, BOOL remove_pagenum)
   {
-  KMSString *new_string = kmsstring_create ("");
-  // We have to do & first, as later substitutions will insert new & chars
+  BOOL ret = TRUE;
+  KMSString *xml = out->xml;
+  int lines = first ? 0 : 1;
+  KMSInputLine line;
 
-  unsigned char *line1 = (unsigned char *)text_subs_verbatim (line);
-  unsigned char *old_line1 = line1;
-  
-  BOOL verbatim = FALSE;
-  while (*line1)
+  // Temporary memory used while formatting a line comes from an arena
+  //  that belongs to this chapter, and is reset after every line.
+  KMSArena *arena = kmsarena_create (TEXT_ARENA_BLOCK);
+  KMSArenaMark line_mark = kmsarena_mark (arena);
+
+  while (kmsinput_next_text_line (input, &line))
     {
-    switch (*line1)
+    // A blank line is formatted with its newline, and everything else
+    //  without. A line of one character has always been treated as 
+    //  blank, for better or worse.
+    KMSStringView text = line.text;
+    if (!line.blank) 
+      text.len = line.len;
+    BOOL blank = (text.len <= 1);
+    if (blank)
       {
-      case '&':
-        if (verbatim)
-          kmsstring_append_c (new_string, '&'); 
-        else
-          kmsstring_append (new_string, "&amp;"); 
-        break;
-
-      case '>':
-        if (verbatim)
-          kmsstring_append_c (new_string, '>'); 
-        else
-          kmsstring_append (new_string, "&gt;"); 
-        break;
-
-      case '<':
-        if (verbatim)
-          kmsstring_append_c (new_string, '<'); 
-        else
-          kmsstring_append (new_string, "&lt;"); 
-        break;
-
-      case VERBATIM_BYTE: 
-        verbatim = !verbatim;
-        break;
+      kmsstring_append (xml, "</p>\n");
+      }
+    if (first_is_title && (lines == 0))
+      {
+      kmsstring_append (xml, "<h1>");
+      format_line (xml, arena, text, indent_is_para, markdown, 
+	remove_pagenum, TRUE);
+      kmsstring_append (xml, "</h1>");
+      }
+    else
+      {
+      format_line (xml, arena, text, indent_is_para, markdown, 
+	remove_pagenum, (lines == 0));
+      }
 
-      default:
-        kmsstring_append_c (new_string, *line1);
+    if (blank)
+      {
+      kmsstring_append (xml, "<p>\n");
       }
-    line1++;
-    }
 
-  free (old_line1);
+    kmsstring_append (xml, "\n");
+    if (line_paras)
+      kmsstring_append (xml, "</p><p>\n");
+    kmsarena_reset (arena, line_mark);
+    lines++;
 
-  char *ret = strdup (kmsstring_cstr (new_string)); 
-  kmsstring_destroy (new_string);
+    if (!text_out_update (out, FALSE))
+      {
+      ret = FALSE;
+      break;
+      }
+    } 
+  kmsarena_destroy (arena);
   return ret;
   }
 
 /*==========================================================================
-  format_line 
-  Note -- line may (in theory) be a magabyte long
+  TextChunks 
+  A large file divided into pieces, to be formatted at the same time.
 ==========================================================================*/
-static char *format_line (const char *line, BOOL indent_is_para, 
-    BOOL markdown, BOOL remove_pagenum, BOOL first_line)
+typedef struct _TextChunks
   {
-  char *escaped_line = escape_html (line); 
-
-  char *line1; 
-
-  if (remove_pagenum)
-    line1 = text_subs_pagenum (escaped_line);
-  else
-    line1 = strdup (escaped_line); 
-
-  free (escaped_line);
+  char *data;
+  size_t *start;        // Offset of each chunk, and of the end of data
+  KMSString **out;      // The formatted text of each chunk
+  uint32_t *crc;        // And its CRC
+  BOOL *done;           // And whether it was finished
+  size_t max;           // The most text there may be, in all
+  BOOL indent_is_para;
+  BOOL markdown;
+  BOOL first_is_title;
+  BOOL line_paras;
+  BOOL remove_pagenum;
+  } TextChunks;
 
-  char *md_out;
-  if (markdown)
+/*==========================================================================
+  text_find_split
+  Find a place at or after offset from to divide the text. This is just 
+  after a blank line, if there is one within TEXT_SPLIT_SEARCH bytes,
+  or else at the start of the next line. Lines with nothing but 
+  carriage returns in them are blank. Returns len if there is no
+  suitable place.
+==========================================================================*/
+static size_t text_find_split (const char *data, size_t len, size_t from)
+  {
+  const char *nl = memchr (data + from, '\n', len - from);
+  if (!nl) return len;
+  size_t next = nl - data + 1;
+  size_t limit = len - next > TEXT_SPLIT_SEARCH ? 
+    next + TEXT_SPLIT_SEARCH : len;
+  size_t p = next;
+  while (p < limit)
     {
-    char *line2 = text_subs_bold (line1);
-    char *line3 = text_subs_italic (line2);
-    free (line2);
-    char *line4 = text_subs_h3 (line3);
-    free (line3);
-    char *line5 = text_subs_h2 (line4);
-    free (line4);
-    char *line6 = text_subs_h1 (line5);
-    free (line5);
-    char *line7 = text_subs_br (line6);
-    free (line6);
-    md_out = line7;
+    size_t q = p;
+    while (q < len && data[q] == '\r') q++;
+    if (q < len && data[q] == '\n') return q + 1;
+    nl = memchr (data + q, '\n', len - q);
+    if (!nl) break;
+    p = nl - data + 1;
     }
-  else
+  return next;
+  }
+
+/*==========================================================================
+  format_chunk 
+==========================================================================*/
+static void format_chunk (int i, void *arg)
+  {
+  TextChunks *c = arg;
+  size_t len = c->start[i + 1] - c->start[i];
+  KMSInput *input = kmsinput_open_buffer (c->data + c->start[i], len);
+  TextOut out = { kmsstring_create_empty () };
+  out.max = c->max;
+  kmsstring_reserve (out.xml, len + len / 4 + 1024);
+  c->done[i] = format_lines (&out, input, i == 0, c->indent_is_para, 
+    c->markdown, c->first_is_title, c->line_paras, c->remove_pagenum)
+    && text_out_update (&out, TRUE);
+  c->out[i] = out.xml;
+  c->crc[i] = out.crc;
+  kmsinput_close (input);
+  }
+
+/*==========================================================================
+  format_chunks
+  Divide len bytes of data into chunks, on up to jobs threads, and 
+  append the results in order to out, which has no sink. Returns FALSE,
+  with nothing appended, if the results would make out longer than its
+  maximum.
+==========================================================================*/
+static BOOL format_chunks (TextOut *out, char *data, size_t len, 
+     int jobs, BOOL indent_is_para, BOOL markdown, BOOL first_is_title, 
+     BOOL line_paras, BOOL remove_pagenum)
+  {
+  // Several chunks for each job evens out the work, when some parts 
+  //  of the text take longer to format than others
+  size_t n = (size_t)jobs * TEXT_CHUNKS_PER_JOB;
+  if (n > len / TEXT_CHUNK_MIN) n = len / TEXT_CHUNK_MIN;
+  if (n < 1) n = 1;
+
+  TextChunks c = { data, malloc ((n + 1) * sizeof (size_t)), 
+    malloc (n * sizeof (KMSString *)), malloc (n * sizeof (uint32_t)),
+    malloc (n * sizeof (BOOL)), out->max, indent_is_para, markdown, 
+    first_is_title, line_paras, remove_pagenum };
+
+  size_t k, chunks = 0;
+  c.start[0] = 0;
+  for (k = 1; k < n && c.start[chunks] < len; k++)
     {
-    md_out = strdup (line1);
+    size_t target = len / n * k;
+    if (target < c.start[chunks]) target = c.start[chunks];
+    size_t split = text_find_split (data, len, target);
+    if (split >= len) break;
+    c.start[++chunks] = split;
     }
+  c.start[++chunks] = len;
+  kmslog_debug ("Formatting %d chunks", (int)chunks);
 
-  free (line1);
-
-  char *line4;
+  kmsparallel_for (jobs, chunks, format_chunk, &c);
 
-  if (indent_is_para && !first_line)
+  size_t total = kmsstring_length (out->xml);
+  BOOL ret = TRUE;
+  for (k = 0; k < chunks; k++)
     {
-    // Don't process indents as para breaks if this is the first
-    //   line of the file
-    line4 = text_subs_indent (md_out);
+    total += kmsstring_length (c.out[k]);
+    if (!c.done[k]) ret = FALSE;
     }
-  else
-    line4 = strdup (md_out); 
-
-   char *line5 = strdup (line4);
+  if (out->max && total > out->max) ret = FALSE;
 
-  free (line4);
+  // Each chunk's CRC was worked out as it was formatted, so they only
+  //  have to be joined
+  text_out_update (out, TRUE);
+  for (k = 0; k < chunks; k++)
+    {
+    size_t clen = kmsstring_length (c.out[k]);
+    if (ret)
+      {
+      kmsstring_append_n (out->xml, kmsstring_cstr (c.out[k]), clen);
+      out->crc = kmscrc_combine (out->crc, c.crc[k], clen);
+      out->counted += clen;
+      }
+    kmsstring_destroy (c.out[k]);
+    }
+  free (c.out);
+  free (c.crc);
+  free (c.done);
+  free (c.start);
+  return ret;
+  }
 
-  free (md_out);
-  return line5;
+/*==========================================================================
+  text_is_xhtml
+  Whether a file is taken to be XHTML already, and copied as it is, 
+  rather than formatted
+==========================================================================*/
+BOOL text_is_xhtml (const char *textfile)
+  {
+  return strstr (textfile, ".xhtml") != NULL;
   }
 
 /*==========================================================================
-  input_file_to_html 
-  If the input file is already XHTML we don't have to format it further --
-    we just apply the relevant EPUB header and footer. Everthing else is
-    assumed to be plain UTF8 text, which must be formated as XHTML.
+  text_convert
+  Format everything from input as an XHTML document, appending it to xml.
+  textfile is the name of the input file, which tells us if it is 
+  already XHTML. If input is NULL, because the file could not be opened,
+  the document says so. A large text file is divided up, and formatted 
+  on up to jobs threads. If out has a sink, the document is handed
+  to it in pieces, and out->xml is left empty; otherwise out->xml holds
+  the whole document, and out->crc its CRC. Returns FALSE if the sink 
+  fails, or the document would be longer than out->max.
 ==========================================================================*/
-// TODO -- stdin
-char *input_file_to_xhtml (const char *textfile, const char *title, 
-     BOOL indent_is_para, BOOL markdown, BOOL first_is_title, BOOL line_paras,
-     BOOL remove_pagenum, BOOL para_indent)
+static BOOL text_convert (TextOut *out, KMSInput *input, 
+     const char *textfile, const char *title, BOOL indent_is_para, 
+     BOOL markdown, BOOL first_is_title, BOOL line_paras, 
+     BOOL remove_pagenum, BOOL para_indent, int jobs)
   {
+  BOOL ret = TRUE;
+  KMSString *xml = out->xml;
+  TextSink sink = out->sink;
   kmslog_info ("Processing file %s", textfile);
 
-  KMSString *xml = kmsstring_create_empty();
-
   kmsstring_append (xml, "<?xml version=\"1.0\"  encoding=\"UTF-8\"?>\n");
   kmsstring_append (xml, "<html xmlns=\"http://www.w3.org/1999/xhtml\">\n");
   kmsstring_append (xml, "<head>\n");
@@ -661,70 +1084,35 @@ char *input_file_to_xhtml (const char *textfile, const char *title,
   kmsstring_append (xml, "<body>\n");
   kmsstring_append (xml, "<p>\n");
 
-  BOOL is_xhtml = FALSE;
-  if (strstr (textfile, ".xhtml"))
-    is_xhtml = TRUE;
+  BOOL is_xhtml = text_is_xhtml (textfile);
 
-  FILE *f;
-  if (strcmp (textfile, "-") == 0)
-    f = stdin;
-  else
-    f = fopen (textfile, "r");
-  if (f)
+  if (input)
     {
-    BOOL done = FALSE;
-    int lines = 0;
-    do
+    // Formatting rarely adds more than a quarter to the size of the
+    //  text, so reserving that much saves growing the buffer repeatedly
+    off_t size = kmsinput_size (input);
+    size_t want = size + size / 4 + 1024;
+    if (out->max && want > out->max) want = out->max;
+    if (!sink && size >= 0)
+      kmsstring_reserve (xml, want);
+
+    size_t len;
+    char *data = kmsinput_data (input, &len);
+    if (is_xhtml)
       {
-      size_t n = 0;
-      char *line = NULL;
-      if (getline (&line, &n, f) < 0) done = TRUE;
-      if (!done)
+      KMSStringView line;
+      while (ret && kmsinput_next_line (input, &line))
         {
-        if (is_xhtml)
-          {
-	  kmsstring_append (xml, line);
-          }
-        else
-          {
-	  strip_cr (line);
-	  if (strlen (line) > 1)
-	    {
-	    if (line[strlen(line) - 1] == 10)
-	      line[strlen(line) - 1] = 0;
-	    }
-	  if (strlen (line) <= 1)
-	    {
-	    kmsstring_append (xml, "</p>\n");
-	    }
-	  char *newline = format_line (line, indent_is_para, markdown, 
-	    remove_pagenum, (lines == 0));
-	  if (first_is_title && (lines == 0))
-	    {
-	    kmsstring_append (xml, "<h1>");
-	    kmsstring_append (xml, newline);
-	    kmsstring_append (xml, "</h1>");
-	    }
-	  else
-	    {
-	    kmsstring_append (xml, newline);
-	    }
-
-	  if (strlen (line) <= 1)
-	    {
-	    kmsstring_append (xml, "<p>\n");
-	    }
-
-	  kmsstring_append (xml, "\n");
-	  if (line_paras)
-	    kmsstring_append (xml, "</p><p>\n");
-          free (newline);
-          }
-        lines++;
-        } 
-      if (line) free (line);
-      } while (!done); 
-    fclose (f);
+        kmsstring_append_view (xml, line);
+        ret = text_out_update (out, FALSE);
+        }
+      }
+    else if (!sink && data && jobs > 1 && len >= 2 * TEXT_CHUNK_MIN)
+      ret = format_chunks (out, data, len, jobs, indent_is_para, 
+        markdown, first_is_title, line_paras, remove_pagenum);
+    else
+      ret = format_lines (out, input, TRUE, indent_is_para, markdown, 
+        first_is_title, line_paras, remove_pagenum);
     }
   else
     {
@@ -736,9 +1124,53 @@ char *input_file_to_xhtml (const char *textfile, const char *title,
   kmsstring_append (xml, "</body>\n");
   kmsstring_append (xml, "</html>\n");
 
-  char *ss = strdup (kmsstring_cstr (xml));
-  kmsstring_destroy (xml);
-  return ss; 
+  if (ret)
+    ret = text_out_update (out, TRUE);
+  return ret;
+  }
+
+/*==========================================================================
+  text_input_to_xhtml
+  Format everything from input as an XHTML document; see text_convert.
+  If crc is not NULL, it is set to the CRC-32 of the document, which is 
+  worked out as it is formatted. If max is not 0, and the document turns
+  out to be longer than max bytes, formatting stops, and NULL is 
+  returned; the input then has to be opened again to convert it.
+==========================================================================*/
+KMSString *text_input_to_xhtml (KMSInput *input, const char *textfile, 
+     const char *title, BOOL indent_is_para, BOOL markdown, 
+     BOOL first_is_title, BOOL line_paras, BOOL remove_pagenum, 
+     BOOL para_indent, int jobs, size_t max, uint32_t *crc)
+  {
+  TextOut out = { kmsstring_create_empty() };
+  out.max = max;
+  if (!text_convert (&out, input, textfile, title, indent_is_para, 
+       markdown, first_is_title, line_paras, remove_pagenum, para_indent, 
+       jobs))
+    {
+    kmsstring_destroy (out.xml);
+    return NULL;
+    }
+  if (crc) *crc = out.crc;
+  return out.xml;
   }
 
+/*==========================================================================
+  text_input_to_sink
+  Format everything from input as an XHTML document, handing it to sink
+  in pieces of about TEXT_FLUSH_SIZE bytes, so the memory needed does 
+  not depend on the size of the input. Returns FALSE if the sink fails.
+==========================================================================*/
+BOOL text_input_to_sink (KMSInput *input, const char *textfile, 
+     const char *title, BOOL indent_is_para, BOOL markdown, 
+     BOOL first_is_title, BOOL line_paras, BOOL remove_pagenum, 
+     BOOL para_indent, TextSink sink, void *arg)
+  {
+  TextOut out = { kmsstring_create_empty(), sink, arg };
+  kmsstring_reserve (out.xml, 2 * TEXT_FLUSH_SIZE);
+  BOOL ret = text_convert (&out, input, textfile, title, indent_is_para, 
+    markdown, first_is_title, line_paras, remove_pagenum, para_indent, 1);
+  kmsstring_destroy (out.xml);
+  return ret;
+  }
 
@@ -6,8 +6,23 @@ Copyright (c)2017 Kevin Boone, GPLv3.0
 
 #pragma once
 
-char *input_file_to_xhtml (const char *textfile, const char *title,
-        BOOL indent_is_para, BOOL markdown, BOOL first_is_title, 
-        BOOL line_paras, BOOL remove_pagenum, BOOL para_indent);
+#include <stdint.h>
+#include "kmsstring.h"
+#include "kmsinput.h"
+
+// A TextSink takes formatted text, a piece at a time, when a file is 
+//  converted by streaming. It returns FALSE if it can't take any more.
+typedef BOOL (*TextSink) (const char *data, size_t len, void *arg);
+
+KMSString *text_input_to_xhtml (KMSInput *input, const char *textfile, 
+        const char *title, BOOL indent_is_para, BOOL markdown, 
+        BOOL first_is_title, BOOL line_paras, BOOL remove_pagenum, 
+        BOOL para_indent, int jobs, size_t max, uint32_t *crc);
+BOOL text_input_to_sink (KMSInput *input, const char *textfile, 
+        const char *title, BOOL indent_is_para, BOOL markdown, 
+        BOOL first_is_title, BOOL line_paras, BOOL remove_pagenum, 
+        BOOL para_indent, TextSink sink, void *arg);
+BOOL text_is_xhtml (const char *textfile);
 void text_init_regex (const char *verbatim_marker);
 void text_cleanup_regex (void);
+void text_cleanup_thread (void);
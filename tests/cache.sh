@@ -0,0 +1,33 @@
+#!/usr/bin/bash
+# Build a book with --cache, in a cache of its own: once to fill the
+#  cache, once from it, once after changing a chapter, and once with
+#  different compression. Each time, the chapters should be just what
+#  they are without the cache.
+
+TXT2EPUB=$(realpath ../txt2epub)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+export XDG_CACHE_HOME=$DIR/cache
+
+cp mixed.txt ch1.txt ch2.txt "$DIR"
+cd "$DIR"
+
+check ()
+  {
+  $TXT2EPUB $2 -t cache -o plain.epub mixed.txt ch1.txt ch2.txt
+  $TXT2EPUB $2 --cache -t cache -o cached.epub mixed.txt ch1.txt ch2.txt
+  unzip -tq cached.epub > /dev/null || { echo "cache: bad archive"; exit 1; }
+  for e in file0.html file1.html file2.html; do
+    cmp -s <(unzip -p plain.epub $e) <(unzip -p cached.epub $e) \
+      || { echo "cache: $e differs $1"; exit 1; }
+  done
+  }
+
+check "when filling the cache"
+N=$(ls cache/txt2epub | wc -l)
+[ $N -eq 3 ] || { echo "cache: $N files cached, not 3"; exit 1; }
+check "when read from the cache"
+echo "A new last line." >> ch2.txt
+check "after a change"
+check "with other compression" "--compression store"
+echo "cache: OK"
@@ -0,0 +1,39 @@
+#!/usr/bin/bash
+# Name the chapters of a book on the command line, as a directory, and
+#  in an input list, and check that each way makes the same EPUB. The
+#  files in a directory should be in natural order, without hidden
+#  files or subdirectories.
+
+TXT2EPUB=$(realpath ../txt2epub)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+mkdir -p "$DIR/book/extra"
+cp ch1.txt "$DIR/book/ch1.txt"
+cp ch2.txt "$DIR/book/ch2.txt"
+cp mixed.txt "$DIR/book/ch10.txt"
+cp ch1.txt "$DIR/book/.hidden.txt"
+cp ch1.txt "$DIR/book/extra/ch3.txt"
+cd "$DIR"
+
+$TXT2EPUB --reproducible -t book -o args.epub \
+  book/ch1.txt book/ch2.txt book/ch10.txt
+unzip -tq args.epub > /dev/null || { echo "inputs: bad archive"; exit 1; }
+
+$TXT2EPUB --reproducible -t book book/
+[ -f book.epub ] || { echo "inputs: directory did not make book.epub"; exit 1; }
+cmp -s args.epub book.epub || { echo "inputs: directory differs"; exit 1; }
+
+# Blank lines are ignored, and line ends may be DOS ones
+printf 'book/ch1.txt\r\n\nbook/ch2.txt\n' > list
+$TXT2EPUB --reproducible -t book -o list.epub --input-list list \
+  book/ch10.txt
+cmp -s args.epub list.epub || { echo "inputs: input list differs"; exit 1; }
+
+printf 'book/ch1.txt\nbook/ch2.txt\nbook/ch10.txt' \
+  | $TXT2EPUB --reproducible -t book -o stdin.epub --input-list -
+cmp -s args.epub stdin.epub || { echo "inputs: list on stdin differs"; exit 1; }
+
+$TXT2EPUB -t book -o none.epub --input-list missing > /dev/null 2>&1 \
+  && { echo "inputs: missing input list accepted"; exit 1; }
+echo "inputs: OK"
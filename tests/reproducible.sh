@@ -0,0 +1,38 @@
+#!/usr/bin/bash
+# Build the same book twice with --reproducible, at different times and
+#  with different numbers of jobs, and check that the EPUBs are the 
+#  same, byte for byte. Then check that SOURCE_DATE_EPOCH and the text 
+#  each make a difference, even if the text comes from stdin.
+
+TXT2EPUB=$(realpath ../txt2epub)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cp mixed.txt ch1.txt ch2.txt "$DIR"
+cd "$DIR"
+BOOK="-t book -a author mixed.txt ch1.txt ch2.txt"
+
+$TXT2EPUB --reproducible -j 1 -o 1.epub $BOOK
+# ZIP times are to the nearest two seconds
+sleep 2
+$TXT2EPUB --reproducible -j 3 -o 2.epub $BOOK
+unzip -tq 1.epub > /dev/null || { echo "reproducible: bad archive"; exit 1; }
+cmp -s 1.epub 2.epub || { echo "reproducible: builds differ"; exit 1; }
+
+SOURCE_DATE_EPOCH=1700000000 $TXT2EPUB --reproducible -o 3.epub $BOOK
+SOURCE_DATE_EPOCH=1700000000 $TXT2EPUB --reproducible -o 4.epub $BOOK
+cmp -s 3.epub 4.epub || { echo "reproducible: builds differ with epoch"; exit 1; }
+cmp -s 1.epub 3.epub && { echo "reproducible: SOURCE_DATE_EPOCH ignored"; exit 1; }
+
+echo "One more line." >> ch2.txt
+$TXT2EPUB --reproducible -o 5.epub $BOOK
+cmp -s <(unzip -p 1.epub content.opf) <(unzip -p 5.epub content.opf) \
+  && { echo "reproducible: identifier does not depend on the text"; exit 1; }
+
+$TXT2EPUB --reproducible -t stdin -o 6.epub - < mixed.txt
+$TXT2EPUB --reproducible -t stdin -o 7.epub - < mixed.txt
+$TXT2EPUB --reproducible -t stdin -o 8.epub - < ch1.txt
+cmp -s 6.epub 7.epub || { echo "reproducible: builds from stdin differ"; exit 1; }
+cmp -s <(unzip -p 6.epub content.opf) <(unzip -p 8.epub content.opf) \
+  && { echo "reproducible: identifier does not depend on stdin"; exit 1; }
+echo "reproducible: OK"
@@ -0,0 +1,122 @@
+#!/usr/bin/bash
+# Convert a generated text file, several GB long, with --stream, with
+#  virtual memory limited to STREAM_LIMIT_KB. Memory use should not
+#  depend on the size of the input, so this should work for any size.
+#  Then write a small EPUB to a pipe, with and without --stream, and
+#  check that it can be read as a stream, and that chapter titles, and
+#  --rsyncable output, are the same however it is made.
+
+# Read a ZIP archive from stdin in one pass, without the central 
+#  directory, as Java's ZipInputStream and other streaming readers do,
+#  and check every entry's CRC. Such a reader can only find the end of 
+#  a stored entry from the sizes in its local header.
+stream_unzip () {
+  python3 -c '
+import struct, sys, zlib
+buf = sys.stdin.buffer.read()
+pos = 0
+while buf[pos:pos + 4] == b"PK\x03\x04":
+  (flags, method, crc, clen, ulen, nlen, xlen) = \
+    struct.unpack ("<6xHH4xIIIHH", buf[pos:pos + 30])
+  name = buf[pos + 30:pos + 30 + nlen].decode ()
+  extra = buf[pos + 30 + nlen:pos + 30 + nlen + xlen]
+  pos += 30 + nlen + xlen
+  zip64 = extra[:2] == b"\x01\x00"
+  if zip64 and not flags & 8:
+    ulen, clen = struct.unpack ("<QQ", extra[4:20])
+  if flags & 8 and method == 0:
+    sys.exit ("%s: stored, with sizes after the data" % name)
+  if method == 8:
+    d = zlib.decompressobj (-15)
+    data = d.decompress (buf[pos:])
+    pos = len (buf) - len (d.unused_data)
+  else:
+    data = buf[pos:pos + clen]
+    pos += clen
+  if flags & 8:
+    if buf[pos:pos + 4] == b"PK\x07\x08": pos += 4
+    crc = struct.unpack ("<I", buf[pos:pos + 4])[0]
+    pos += 20 if zip64 else 12
+  if zlib.crc32 (data) != crc:
+    sys.exit ("%s: bad CRC" % name)
+  print (name)
+'
+}
+
+SIZE=${STREAM_SIZE:-2G}
+LIMIT_KB=${STREAM_LIMIT_KB:-65536}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+yes "The quick brown fox jumps over the *lazy* dog, & so on." \
+  | head -c $SIZE > "$DIR/big.txt"
+
+(ulimit -v $LIMIT_KB; ../txt2epub --stream -o "$DIR/big.epub" "$DIR/big.txt")
+if [ $? -ne 0 ]; then
+  echo "streaming: conversion failed with a $LIMIT_KB kB limit"
+  exit 1
+fi
+
+unzip -tq "$DIR/big.epub" || { echo "streaming: bad archive"; exit 1; }
+
+# Writing to a pipe, which can't seek, should give the same contents
+../txt2epub -t mixed -o "$DIR/file.epub" mixed.txt ch1.txt
+../txt2epub -t mixed -o - mixed.txt ch1.txt | cat > "$DIR/pipe.epub"
+../txt2epub -t mixed --stream -o - mixed.txt ch1.txt | cat > "$DIR/spipe.epub"
+for f in pipe spipe; do
+  unzip -tq "$DIR/$f.epub" > /dev/null || { echo "streaming: bad $f"; exit 1; }
+  for e in file0.html file1.html; do
+    cmp -s <(unzip -p "$DIR/file.epub" $e) <(unzip -p "$DIR/$f.epub" $e) \
+      || { echo "streaming: $e differs in $f"; exit 1; }
+  done
+done
+# Input from a pipe has no size, so it should be streamed without 
+#  --stream. Only the title, which is taken from the file name, differs
+cat mixed.txt | ../txt2epub -t mixed -o "$DIR/stdin.epub" - ch1.txt
+cmp -s <(unzip -p "$DIR/file.epub" file0.html | grep -v '<title>') \
+  <(unzip -p "$DIR/stdin.epub" file0.html | grep -v '<title>') \
+  || { echo "streaming: file0.html differs from stdin"; exit 1; }
+# A streaming reader should be able to read an EPUB from a pipe, even 
+#  with a cover image, or chapters streamed without compression
+printf '\x89PNG\r\n\x1a\n' > "$DIR/cover.png"
+head -c 4096 /dev/urandom >> "$DIR/cover.png"
+../txt2epub -t mixed -c "$DIR/cover.png" -o - mixed.txt ch1.txt \
+  | cat > "$DIR/cover.epub"
+stream_unzip < "$DIR/cover.epub" > /dev/null \
+  || { echo "streaming: cover unreadable"; exit 1; }
+# The cover image is still stored, since it can be read twice
+unzip -v "$DIR/cover.epub" | grep -q " Stored .* cover.png$" \
+  || { echo "streaming: cover not stored"; exit 1; }
+../txt2epub -t mixed --stream --compression store -o - mixed.txt ch1.txt \
+  | stream_unzip > "$DIR/names" || { echo "streaming: store unreadable"; exit 1; }
+grep -qx file1.html "$DIR/names" || { echo "streaming: entries missing"; exit 1; }
+# With --first-lines, a streamed chapter's title, taken as it is read,
+#  should be the same as one converted in memory
+../txt2epub -f -t mixed --reproducible -o "$DIR/first.epub" ch1.txt ch2.txt
+../txt2epub -f -t mixed --reproducible --stream -o "$DIR/sfirst.epub" \
+  ch1.txt ch2.txt
+for e in toc.ncx file0.html file1.html; do
+  cmp -s <(unzip -p "$DIR/first.epub" $e) <(unzip -p "$DIR/sfirst.epub" $e) \
+    || { echo "streaming: $e differs with --first-lines"; exit 1; }
+done
+# With --rsyncable, the EPUB should depend only on the input, byte for 
+#  byte, whether or not it is streamed, and however many jobs there are.
+#  (A streamed entry written to a pipe has a data descriptor, so it
+#  can't be quite the same)
+awk 'BEGIN { srand (1); n = split ("the of and to a in that it was he " \
+  "for on his with as at by be had not but from", w, " ");
+  for (i = 0; i < 200000; i++) 
+    printf "%s%s", w[1 + int (rand () * n)], (i % 12 == 11) ? "\n" : " " }' \
+  > "$DIR/words.txt"
+../txt2epub -t words --rsyncable -j 4 --block-size 64 \
+  -o "$DIR/rs.epub" "$DIR/words.txt" mixed.txt
+../txt2epub -t words --rsyncable --stream --block-size 64 \
+  -o "$DIR/rsstream.epub" "$DIR/words.txt" mixed.txt
+../txt2epub -t words --rsyncable --block-size 64 \
+  -o - "$DIR/words.txt" mixed.txt | cat > "$DIR/rspipe.epub"
+unzip -tq "$DIR/rs.epub" > /dev/null || { echo "streaming: bad rsyncable"; exit 1; }
+for f in rsstream rspipe; do
+  cmp -s "$DIR/rs.epub" "$DIR/$f.epub" \
+    || { echo "streaming: rsyncable $f differs"; exit 1; }
+done
+echo "streaming: OK"